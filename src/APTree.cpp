@@ -198,22 +198,40 @@ APTree::APTree_p APTree::bn(arma::mat &x, size_t &row_ind)
     }
 }
 
-void APTree::tonull()
+APTree::~APTree()
+{
+    if (owns_arena)
+    {
+        delete arena;
+    }
+}
+
+APTree_arena *APTree::get_arena()
 {
-    size_t ts = treesize();
-    //loop invariant: ts>=1
-    while (ts > 1)
-    { //if false ts=1
-        npv nv;
-        getnogs(nv);
-        for (size_t i = 0; i < nv.size(); i++)
+    if (!arena)
+    {
+        if (p)
         {
-            delete nv[i]->l;
-            delete nv[i]->r;
-            nv[i]->l = 0;
-            nv[i]->r = 0;
+            // share the arena of the tree
+            arena = p->get_arena();
         }
-        ts = treesize(); //make invariant true
+        else
+        {
+            // the root creates the arena on the first split
+            arena = new APTree_arena;
+            owns_arena = true;
+        }
+    }
+    return arena;
+}
+
+void APTree::tonull()
+{
+    // all nodes below the root live in its arena, release them in one shot
+    // for a subtree the children are only detached, the arena frees them together with the tree
+    if (owns_arena)
+    {
+        arena->clear();
     }
     v = 0;
     c = 0;
@@ -240,10 +258,10 @@ void APTree::cp(APTree_p n, APTree_cp o)
 
     if (o->l)
     { //if o has children
-        n->l = new APTree;
+        n->l = n->get_arena()->make();
         (n->l)->p = n;
         cp(n->l, o->l);
-        n->r = new APTree;
+        n->r = n->get_arena()->make();
         (n->r)->p = n;
         cp(n->r, o->r);
     }
@@ -348,7 +366,7 @@ std::istream &operator>>(std::istream &is, APTree &t)
     //now loop through the rest of the nodes knowing parent is already there.
     for (size_t i = 1; i != nv.size(); i++)
     {
-        APTree::APTree_p np = new APTree;
+        APTree::APTree_p np = t.get_arena()->make();
         np->v = nv[i].v;
         np->c = nv[i].c;
         np->theta = nv[i].theta;
@@ -368,37 +386,48 @@ std::istream &operator>>(std::istream &is, APTree &t)
     return is;
 }
 
-void APTree::split_Xorder(arma::umat &Xorder_left, arma::umat &Xorder_right, arma::umat &Xorder, size_t split_point, size_t split_var, State &state)
+void APTree::split_Xorder(size_t split_var, size_t split_point, double cutvalue, bool use_bin_code, State &state)
 {
-    size_t num_obs = Xorder.n_rows;
+    // stable partition of the rows of this node, in every column of the shared Xorder
+    // left side first, so both children are contiguous and every column stays sorted
+    // only the right side needs scratch space, no new N * p matrix per split
+    size_t num_obs = this->N;
+    size_t left_index;
+    uint32_t row_ind;
+    bool left;
 
-    double cutvalue = state.split_candidates[split_point];
+    std::vector<uint32_t> right_rows;
+    right_rows.reserve(num_obs);
 
-    size_t left_index;
-    size_t right_index;
     for (size_t i = 0; i < state.p; i++)
     {
-        left_index = 0;
-        right_index = 0;
-
         // loop over variables
+        left_index = this->Xorder_begin;
+        right_rows.clear();
+
         for (size_t j = 0; j < num_obs; j++)
         {
-
             // loop over observations
-            if ((*state.X)(Xorder(j, i), split_var) <= cutvalue)
+            row_ind = (*Xorder)(this->Xorder_begin + j, i);
+            left = use_bin_code ? ((*state.bin_code)(row_ind, split_var) <= split_point) : ((*state.X)(row_ind, split_var) <= cutvalue);
+
+            if (left)
             {
-                // left side
-                Xorder_left(left_index, i) = Xorder(j, i);
+                // left side, never overwrites an unread row
+                (*Xorder)(left_index, i) = row_ind;
                 left_index++;
             }
             else
             {
                 // right side
-                Xorder_right(right_index, i) = Xorder(j, i);
-                right_index++;
+                right_rows.push_back(row_ind);
             }
         }
+
+        for (size_t j = 0; j < right_rows.size(); j++)
+        {
+            (*Xorder)(left_index + j, i) = right_rows[j];
+        }
     }
     return;
 }
@@ -427,17 +456,8 @@ void APTree::from_json(json &j3, size_t dim_theta)
 {
     if (j3.is_array())
     {
-        // this is the leaf
-        std::vector<double> temp;
-        j3.get_to(temp);
-        if (temp.size() > 1)
-        {
-            this->theta = temp;
-        }
-        else
-        {
-            this->theta[0] = temp[0];
-        }
+        // this is the leaf, theta keeps the length stored for it
+        j3.get_to(this->theta);
     }
     else
     {
@@ -447,19 +467,21 @@ void APTree::from_json(json &j3, size_t dim_theta)
         j3.at("cutpoint_index").get_to(this->c_index);
         j3.at("depth").get_to(this->depth);
 
-        APTree *lchild = new APTree(dim_theta);
-        lchild->from_json(j3["left"], dim_theta);
-        APTree *rchild = new APTree(dim_theta);
-        rchild->from_json(j3["right"], dim_theta);
+        // link the children first, so they find the arena of the tree
+        APTree *lchild = this->get_arena()->make(dim_theta);
+        APTree *rchild = this->get_arena()->make(dim_theta);
 
         lchild->p = this;
         rchild->p = this;
         this->l = lchild;
         this->r = rchild;
+
+        lchild->from_json(j3["left"], dim_theta);
+        rchild->from_json(j3["right"], dim_theta);
     }
 }
 
-void APTree::grow(bool &break_flag, APTreeModel &model, State &state, size_t &iter, std::vector<double> &criterion_values)
+void APTree::grow(bool &break_flag, APTreeModel &model, State &state, size_t &iter, std::vector<double> &criterion_values, std::ostream &messages)
 {
     std::vector<APTree *> bottom_nodes_vec;
     std::vector<bool> node_splitability;
@@ -492,13 +514,13 @@ void APTree::grow(bool &break_flag, APTreeModel &model, State &state, size_t &it
         }
         else
         {
-            cout << "break of no good candidate" << endl;
+            messages << "break of no good candidate" << endl;
             break_flag = true;
         }
     }
     else
     {
-        cout << "break of no node splitable" << endl;
+        messages << "break of no node splitable" << endl;
         break_flag = true;
     }
 
@@ -548,3 +570,119 @@ void APTree::grow_APTree_TS(bool &break_flag, APTreeModel &model, State &state)
 
     return;
 }
+
+size_t APTree_flat::push_node()
+{
+    var.push_back(0);
+    cutpoint.push_back(0.0);
+    left.push_back(0);
+    leaf_id.push_back(0);
+    return var.size() - 1;
+}
+
+void APTree_flat::from_tree(APTree &root)
+{
+    // breadth first, both children of a node are appended together
+    std::vector<APTree *> queue(1, &root);
+    size_t k;
+
+    var.clear();
+    cutpoint.clear();
+    left.clear();
+    leaf_id.clear();
+    this->push_node();
+
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        if (queue[i]->getl())
+        {
+            var[i] = queue[i]->getv();
+            cutpoint[i] = queue[i]->getc();
+            k = this->push_node();
+            this->push_node();
+            left[i] = k;
+            queue.push_back(queue[i]->getl());
+            queue.push_back(queue[i]->getr());
+        }
+        else
+        {
+            leaf_id[i] = queue[i]->nid();
+        }
+    }
+
+    return;
+}
+
+void APTree_flat::from_json(json &j3)
+{
+    // same layout as from_tree, built from the json nodes without creating an APTree
+    std::vector<json *> queue(1, &j3["tree"]);
+    std::vector<size_t> nid(1, 1);
+    size_t k;
+
+    var.clear();
+    cutpoint.clear();
+    left.clear();
+    leaf_id.clear();
+    this->push_node();
+
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        json &node = *queue[i];
+        if (node.is_array())
+        {
+            // leaf, only theta is saved
+            leaf_id[i] = nid[i];
+        }
+        else
+        {
+            node.at("variable").get_to(var[i]);
+            node.at("cutpoint").get_to(cutpoint[i]);
+            k = this->push_node();
+            this->push_node();
+            left[i] = k;
+            queue.push_back(&node["left"]);
+            queue.push_back(&node["right"]);
+            nid.push_back(nid[i] * 2);
+            nid.push_back(nid[i] * 2 + 1);
+        }
+    }
+
+    return;
+}
+
+void APTree_flat::check_columns(const arma::mat &X) const
+{
+    for (size_t k = 0; k < this->size(); k++)
+    {
+        if (left[k] != 0 && var[k] >= X.n_cols)
+        {
+            Rcpp::stop("the tree splits on column " + std::to_string(var[k] + 1) + " but X has " + std::to_string(X.n_cols) + " columns");
+        }
+    }
+    return;
+}
+
+void APTree_flat::predict(const arma::mat &X, arma::vec &leaf_index) const
+{
+    this->check_columns(X);
+    for (size_t i = 0; i < X.n_rows; i++)
+    {
+        leaf_index(i) = this->find_leaf(X, i);
+    }
+    return;
+}
+
+void APTree_flat::predict(const arma::mat &X, int *leaf_index, size_t num_threads) const
+{
+    // every row is independent and the tree is read only
+    // columns are checked once here, nothing inside the parallel loop can throw
+    this->check_columns(X);
+    size_t N = X.n_rows;
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+    for (size_t i = 0; i < N; i++)
+    {
+        leaf_index[i] = (int)this->find_leaf(X, i);
+    }
+    return;
+}
@@ -10,6 +10,72 @@ using json = nlohmann::json;
 
 class State;
 class APTreeModel;
+class APTree_arena;
+
+// cutpoint sums kept across grow() iterations by all leaves of a tree together, in bytes
+// a leaf beyond it recomputes its cutpoint sums every time they are evaluated
+const size_t leaf_stat_cache_bytes = (size_t)1 << 30;
+
+// per-month sufficient statistics of a leaf, cached across grow() iterations
+// only a split changes the data of a leaf, so split_node drops the cache
+// the cutpoint sums take 3 * num_months * num_cutpoints doubles per evaluated variable
+// so a leaf holds up to 3 * num_months * num_cutpoints * p doubles, bounded by leaf_stat_cache_bytes over all leaves
+class leaf_stat
+{
+public:
+    bool cached;
+    // false if the cutpoint sums are dropped after each evaluation, see leaf_stat_cache_bytes
+    bool keep_left;
+    // sum(w * R), sum(w) and number of stocks of the whole leaf
+    arma::vec weighted_return_all;
+    arma::vec cumu_weight_all;
+    arma::vec num_stocks_all;
+    // the same sums on the left side of every cutpoint, one num_months * num_cutpoints matrix per variable
+    // empty until the variable is evaluated at this leaf
+    std::vector<arma::mat> weighted_return_left;
+    std::vector<arma::mat> cumu_weight_left;
+    std::vector<arma::mat> num_stocks_left;
+
+    leaf_stat() : cached(false), keep_left(true) {}
+
+    void initialize(size_t num_months, size_t p)
+    {
+        weighted_return_all.zeros(num_months);
+        cumu_weight_all.zeros(num_months);
+        num_stocks_all.zeros(num_months);
+        weighted_return_left.assign(p, arma::mat());
+        cumu_weight_left.assign(p, arma::mat());
+        num_stocks_left.assign(p, arma::mat());
+        cached = true;
+        keep_left = true;
+    }
+
+    void clear_left(size_t var)
+    {
+        weighted_return_left[var].reset();
+        cumu_weight_left[var].reset();
+        num_stocks_left[var].reset();
+    }
+
+    void clear_left()
+    {
+        for (size_t var = 0; var < num_stocks_left.size(); var++)
+        {
+            clear_left(var);
+        }
+    }
+
+    void clear()
+    {
+        weighted_return_all.reset();
+        cumu_weight_all.reset();
+        num_stocks_all.reset();
+        std::vector<arma::mat>().swap(weighted_return_left);
+        std::vector<arma::mat>().swap(cumu_weight_left);
+        std::vector<arma::mat>().swap(num_stocks_left);
+        cached = false;
+    }
+};
 
 class APTree
 {
@@ -21,14 +87,30 @@ public:
     typedef std::vector<APTree_cp> cnpv;
 
     //leaf parameters and sufficient statistics
+    // theta is filled for the leaves once the tree is grown, while growing the returns live in APTreeModel::leaf_portfolio
     std::vector<double> theta;
-    arma::umat *Xorder;
+    size_t portfolio_col; // column of this leaf in APTreeModel::leaf_portfolio
+    // one Xorder matrix is shared by the whole tree, a split partitions the rows of the node in place
+    // rows Xorder_begin, ..., Xorder_begin + N - 1 belong to this node, each column sorted by its variable
+    // 32 bit row ids, half the memory traffic of arma::umat in the split sweeps
+    arma::Mat<uint32_t> *Xorder;
+    size_t Xorder_begin;
+    leaf_stat stat;
 
     // constructors
-    APTree() : theta(1, 0.0), Xorder(0), N(0), ID(1), v(0), c_index(0), c(0.0), depth(0), p(0), l(0), r(0), iter(0) {}
-    APTree(size_t dim_theta) : theta(dim_theta, 0.0), Xorder(0), N(0), ID(1), v(0), c_index(0), c(0.0), depth(0), p(0), l(0), r(0), iter(0) {}
-    APTree(size_t dim_theta, arma::umat *Xordermat) : theta(dim_theta, 0.0), Xorder(Xordermat), N(0), ID(1), v(0), c_index(0), c(0.0), depth(0), p(0), l(0), r(0), iter(0) {}
-    APTree(size_t dim_theta, size_t depth, size_t N, size_t ID, APTree_p p, arma::umat *Xordermat) : theta(dim_theta, 0.0), Xorder(Xordermat), N(N), ID(ID), v(0), c_index(0), c(0.0), depth(depth), p(p), l(0), r(0), iter(0) {}
+    APTree() : theta(1, 0.0), portfolio_col(0), Xorder(0), Xorder_begin(0), N(0), ID(1), v(0), c_index(0), c(0.0), depth(0), p(0), l(0), r(0), iter(0), arena(0), owns_arena(false) {}
+    APTree(size_t dim_theta) : theta(dim_theta, 0.0), portfolio_col(0), Xorder(0), Xorder_begin(0), N(0), ID(1), v(0), c_index(0), c(0.0), depth(0), p(0), l(0), r(0), iter(0), arena(0), owns_arena(false) {}
+    APTree(size_t dim_theta, arma::Mat<uint32_t> *Xordermat) : theta(dim_theta, 0.0), portfolio_col(0), Xorder(Xordermat), Xorder_begin(0), N(0), ID(1), v(0), c_index(0), c(0.0), depth(0), p(0), l(0), r(0), iter(0), arena(0), owns_arena(false) {}
+    APTree(size_t dim_theta, size_t depth, size_t N, size_t ID, APTree_p p, arma::Mat<uint32_t> *Xordermat, size_t Xorder_begin) : theta(dim_theta, 0.0), portfolio_col(0), Xorder(Xordermat), Xorder_begin(Xorder_begin), N(N), ID(ID), v(0), c_index(0), c(0.0), depth(depth), p(p), l(0), r(0), iter(0), arena(0), owns_arena(false) {}
+
+    // the root owns the arena of the tree and releases every node in it
+    ~APTree();
+
+    // nodes live in the arena of their tree, copying one would duplicate the ownership
+    APTree(const APTree &) = delete;
+
+    // row index in X of the i-th observation of this node, in the order of variable var
+    uint32_t Xorder_index(size_t i, size_t var) const { return (*Xorder)(Xorder_begin + i, var); }
 
     // functions
     void settheta(std::vector<double> &theta) { this->theta = theta; }
@@ -61,6 +143,7 @@ public:
 
     // tree operation functions
     void tonull();                                // delete the tree
+    APTree_arena *get_arena();                    // arena of the tree, created by the root on first use
     APTree_p getptr(size_t nid);                  // get node pointer from node ID, 0 if not there;
     void pr(bool pc = true);                      // to screen, pc is "print child"
     size_t treesize();                            // return number of nodes in the tree
@@ -79,10 +162,10 @@ public:
     void copy_only_root(APTree_p o);  // copy tree, point new root to old structure
     friend std::istream &operator>>(std::istream &, APTree &);
 
-    void split_Xorder(arma::umat &Xorder_left, arma::umat &Xorder_right, arma::umat &Xorder, size_t split_point, size_t split_var, State &state);
-    void predict(arma::mat X, arma::vec months, arma::vec &output);
+    void split_Xorder(size_t split_var, size_t split_point, double cutvalue, bool use_bin_code, State &state);
 
-    void grow(bool &break_flag, APTreeModel &model, State &state, size_t &iter, std::vector<double> &criterion_values);
+    // messages is where the reason of a break is written, a buffer when trees grow concurrently
+    void grow(bool &break_flag, APTreeModel &model, State &state, size_t &iter, std::vector<double> &criterion_values, std::ostream &messages = std::cout);
     void grow_APTree_TS(bool &break_flag, APTreeModel &model, State &state);
 
     // input and output to json
@@ -101,6 +184,75 @@ private:
     APTree_p p; // pointer to the parent node
     APTree_p l; // pointer to left child
     APTree_p r; // pointer to right child
+
+    APTree_arena *arena; // storage of all nodes below the root
+    bool owns_arena;     // true for the root that created the arena
+};
+
+// storage of all nodes below the root of one tree
+// a deque never moves its elements, so node pointers stay valid as the tree grows
+// clear() releases the whole tree in one shot instead of walking it
+// make() is locked, the regime subtrees of APTree model2 grow concurrently in one arena
+class APTree_arena
+{
+public:
+    template <typename... Args>
+    APTree *make(Args &&...args)
+    {
+        std::lock_guard<std::mutex> lock(nodes_mutex);
+        nodes.emplace_back(std::forward<Args>(args)...);
+        return &nodes.back();
+    }
+
+    void clear() { nodes.clear(); }
+
+    size_t size() const { return nodes.size(); }
+
+private:
+    std::deque<APTree> nodes;
+    std::mutex nodes_mutex;
+};
+
+// immutable copy of a fitted tree for prediction, nodes in one contiguous array in breadth first order
+// the children of an interior node are adjacent, right = left + 1, so traversal is a loop without pointers
+class APTree_flat
+{
+public:
+    std::vector<uint32_t> var;    // split variable of interior nodes
+    std::vector<double> cutpoint; // go left if x <= cutpoint, same as APTree::bn
+    std::vector<uint32_t> left;   // index of the left child, 0 for leaves (the root is never a child)
+    std::vector<size_t> leaf_id;  // nid() of leaves, 0 for interior nodes
+
+    APTree_flat() {}
+    APTree_flat(APTree &root) { this->from_tree(root); }
+    APTree_flat(json &j3) { this->from_json(j3); }
+
+    void from_tree(APTree &root);
+    void from_json(json &j3); // output of tree_to_json
+
+    size_t size() const { return var.size(); }
+
+    // stops if a split variable is not a column of X, find_leaf does not check
+    void check_columns(const arma::mat &X) const;
+
+    size_t find_leaf(const arma::mat &X, size_t row_ind) const
+    {
+        size_t k = 0;
+        while (left[k] != 0)
+        {
+            // !(x <= c) sends NaN to the right, as in APTree::bn
+            k = left[k] + !(X.at(row_ind, var[k]) <= cutpoint[k]);
+        }
+        return leaf_id[k];
+    }
+
+    void predict(const arma::mat &X, arma::vec &leaf_index) const;
+
+    // batch scoring into a preallocated vector of X.n_rows, rows split in chunks across threads
+    void predict(const arma::mat &X, int *leaf_index, size_t num_threads) const;
+
+private:
+    size_t push_node();
 };
 
 // io functions
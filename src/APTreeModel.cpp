@@ -46,76 +46,190 @@ void APTreeModel::calculate_criterion(State &state, std::vector<APTree *> &botto
     std::fill(criterion_values.begin(), criterion_values.end(), std::numeric_limits<double>::max());
     // std::vector<double> criterion_values(num_nodes * num_candidates, std::numeric_limits<double>::max());
 
-    // temp_vector stores criterion evaluation of ONE variable
-    std::vector<double> temp_vector(state.num_cutpoints);
+    // every (node, variable) pair to evaluate, they write to disjoint slices of criterion_values
+    std::vector<size_t> task_node;
+    std::vector<size_t> task_var;
 
-    // three major sufficient statistics, calculate one for each month
-    // sum of weighted returns, sum(w * R)
-    arma::vec weighted_return_all(state.num_months, arma::fill::zeros);
-    // sum of weights, sum(w)
-    arma::vec cumu_weight_all(state.num_months, arma::fill::zeros);
-    // number of stocks
-    arma::vec num_stocks_all(state.num_months, arma::fill::zeros);
+    // portfolios of the other leaves and their factorized covariance, one for each splitable node
+    std::vector<mve_block> blocks(num_nodes);
+
+    // the variant of the criterion for the training modes of this fit
+    criterion_kernel kernel = this->select_criterion_kernel(state);
 
     size_t temp_index;
 
+    // bytes of cutpoint sums of one variable at one leaf, and of those kept by the leaves so far
+    size_t var_cache_bytes = 3 * sizeof(double) * state.num_months * state.num_cutpoints;
+    size_t cache_bytes = 0;
+
     // loop over all current leaf nodes
     for (size_t i = 0; i < num_nodes; i++)
     {
         if (!node_splitability[i])
         {
             // if cannot split here, do nothing, the split criterion value will remain infinite
+            // depth and size of a leaf never change, so its cutpoint sums are not needed again
+            if (bottom_nodes_vec[i]->stat.cached)
+            {
+                bottom_nodes_vec[i]->stat.clear_left();
+            }
         }
         else
         {
             // this node is splitable, checkout split candidates
-            // calculate sufficient statistics for a node
-            node_sufficient_stat(state, *(bottom_nodes_vec[i]->Xorder), weighted_return_all, cumu_weight_all, num_stocks_all);
+            // three major sufficient statistics of a node, one for each month
+            // sum of weighted returns sum(w * R), sum of weights sum(w) and number of stocks
+            // a leaf keeps them until it is split, so only the new children compute them
+            if (!bottom_nodes_vec[i]->stat.cached)
+            {
+                bottom_nodes_vec[i]->stat.initialize(state.num_months, state.p);
+                node_sufficient_stat(state, bottom_nodes_vec[i], bottom_nodes_vec[i]->stat.weighted_return_all, bottom_nodes_vec[i]->stat.cumu_weight_all, bottom_nodes_vec[i]->stat.num_stocks_all);
+            }
+
+            // the other leaves are fixed while searching splits of this node
+            this->initialize_mve_block(state, bottom_nodes_vec, i, blocks[i]);
+
+            // a variable listed twice would be evaluated by two threads writing the same cache
+            std::vector<bool> var_listed(state.p, false);
 
             if (bottom_nodes_vec[i]->getdepth() == 1)
             {
                 // depth 1, this is the root
+                // note the constraint on variables for the root
                 for (size_t var = 0; var < state.first_split_var->n_elem; var++)
                 {
-                    // loop over variables, note the constraint on variables for the root
                     temp_index = (size_t)(*state.first_split_var)(var);
-                    this->calculate_criterion_one_variable(state, temp_index, bottom_nodes_vec, i, temp_vector, weighted_return_all, cumu_weight_all, num_stocks_all);
-                    for (size_t ind = 0; ind < state.num_cutpoints; ind++)
+                    if (!var_listed[temp_index])
                     {
-                        criterion_values[num_candidates * i + temp_index * state.num_cutpoints + ind] = temp_vector[ind];
+                        var_listed[temp_index] = true;
+                        task_node.push_back(i);
+                        task_var.push_back(temp_index);
                     }
                 }
             }
             else if (bottom_nodes_vec[i]->getdepth() == 2)
             {
                 // depth 2
+                // note the constraint on variables for depth 2
                 for (size_t var = 0; var < state.second_split_var->n_elem; var++)
                 {
-                    // loop over variables, note the constraint on variables for depth 2
                     temp_index = (size_t)(*state.second_split_var)(var);
-                    this->calculate_criterion_one_variable(state, temp_index, bottom_nodes_vec, i, temp_vector, weighted_return_all, cumu_weight_all, num_stocks_all);
-                    for (size_t ind = 0; ind < state.num_cutpoints; ind++)
+                    if (!var_listed[temp_index])
                     {
-                        criterion_values[num_candidates * i + temp_index * state.num_cutpoints + ind] = temp_vector[ind];
+                        var_listed[temp_index] = true;
+                        task_node.push_back(i);
+                        task_var.push_back(temp_index);
                     }
                 }
             }
             else
             {
                 // all other following nodes
-                for (size_t var = 0; var < state.p; var++)
+                // regime subtrees of model2 constrain depth 3 and below, otherwise loop over all variables
+                const arma::vec *deeper_split_var = (bottom_nodes_vec[i]->getdepth() == 3) ? state.third_split_var : state.deep_split_var;
+                if (deeper_split_var)
                 {
-                    // loop over variables, there is no constraint, loop over all variables
-                    this->calculate_criterion_one_variable(state, var, bottom_nodes_vec, i, temp_vector, weighted_return_all, cumu_weight_all, num_stocks_all);
-                    for (size_t ind = 0; ind < state.num_cutpoints; ind++)
+                    for (size_t var = 0; var < deeper_split_var->n_elem; var++)
                     {
-                        criterion_values[num_candidates * i + var * state.num_cutpoints + ind] = temp_vector[ind];
+                        temp_index = (size_t)(*deeper_split_var)(var);
+                        if (!var_listed[temp_index])
+                        {
+                            var_listed[temp_index] = true;
+                            task_node.push_back(i);
+                            task_var.push_back(temp_index);
+                        }
+                    }
+                }
+                else
+                {
+                    for (size_t var = 0; var < state.p; var++)
+                    {
+                        task_node.push_back(i);
+                        task_var.push_back(var);
                     }
                 }
             }
+
+            // the leaf keeps its cutpoint sums while all leaves together stay within leaf_stat_cache_bytes
+            size_t num_vars = std::count(task_node.begin(), task_node.end(), i);
+            cache_bytes += num_vars * var_cache_bytes;
+            bottom_nodes_vec[i]->stat.keep_left = (cache_bytes <= leaf_stat_cache_bytes);
         }
     }
 
+    // evaluate all pairs, in parallel if num_threads > 1
+    // each pair is computed independently and the argmin below is serial
+    // so the chosen split does not depend on the number of threads
+    // an exception must not leave the parallel region, the first one is kept and rethrown after it
+    std::exception_ptr error;
+
+    // the pricing regression runs over all observations, so the scratch regressor of a thread is N rows
+    // a thread allocates its own on its first task, and all are released after the search
+    // the Gram criterion does not use them at all
+    size_t num_Z = (*state.Z).n_cols;
+    if (!state.gram_loss)
+    {
+        this->thread_regressor.assign(state.num_threads - 1, arma::mat());
+    }
+#pragma omp parallel for schedule(dynamic) num_threads(state.num_threads)
+    for (size_t task = 0; task < task_node.size(); task++)
+    {
+        try
+        {
+            size_t i = task_node[task];
+            size_t var = task_var[task];
+            size_t thread_id = omp_get_thread_num();
+
+            // temp_vector stores criterion evaluation of ONE variable
+            std::vector<double> temp_vector(state.num_cutpoints);
+
+            // scratch regressor of this thread, not used by the Gram criterion
+            arma::mat *regressor_pnt = &this->regressor;
+            lm_workspace *lm_work_pnt = &this->lm_work;
+            if (thread_id != 0 && !state.gram_loss)
+            {
+                regressor_pnt = &this->thread_regressor[thread_id - 1];
+                lm_work_pnt = &this->thread_lm_work[thread_id - 1];
+                if (regressor_pnt->n_elem == 0)
+                {
+                    // the kernel overwrites the Z * ft columns, only the H columns are copied
+                    // thread 0 never writes the H columns, so reading them here is safe
+                    regressor_pnt->set_size(this->regressor.n_rows, this->regressor.n_cols);
+                    if (this->regressor.n_cols > num_Z)
+                    {
+                        regressor_pnt->cols(num_Z, this->regressor.n_cols - 1) = this->regressor.cols(num_Z, this->regressor.n_cols - 1);
+                    }
+                }
+            }
+            arma::mat &regressor = *regressor_pnt;
+            lm_workspace &lm_work = *lm_work_pnt;
+
+            (this->*kernel)(state, var, bottom_nodes_vec, i, temp_vector, blocks[i], regressor, lm_work);
+            for (size_t ind = 0; ind < state.num_cutpoints; ind++)
+            {
+                criterion_values[num_candidates * i + var * state.num_cutpoints + ind] = temp_vector[ind];
+            }
+        }
+        catch (...)
+        {
+#pragma omp critical(criterion_error)
+            {
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    // release the N row copies before anything else is allocated
+    std::vector<arma::mat>().swap(this->thread_regressor);
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
     // find the lowest split criterion
     size_t lowest_index = 0;
     double temp = criterion_values[0];
@@ -148,6 +262,32 @@ void APTreeModel::calculate_criterion(State &state, std::vector<APTree *> &botto
     return;
 }
 
+criterion_kernel APTreeModel::select_criterion_kernel(State &state)
+{
+    // one instantiation for every combination of gram_loss, weighted_loss, abs_normalize and stop_no_gain
+    static const criterion_kernel kernels[16] = {
+        &APTreeModel::calculate_criterion_one_variable<false, false, false, false>,
+        &APTreeModel::calculate_criterion_one_variable<false, false, false, true>,
+        &APTreeModel::calculate_criterion_one_variable<false, false, true, false>,
+        &APTreeModel::calculate_criterion_one_variable<false, false, true, true>,
+        &APTreeModel::calculate_criterion_one_variable<false, true, false, false>,
+        &APTreeModel::calculate_criterion_one_variable<false, true, false, true>,
+        &APTreeModel::calculate_criterion_one_variable<false, true, true, false>,
+        &APTreeModel::calculate_criterion_one_variable<false, true, true, true>,
+        &APTreeModel::calculate_criterion_one_variable<true, false, false, false>,
+        &APTreeModel::calculate_criterion_one_variable<true, false, false, true>,
+        &APTreeModel::calculate_criterion_one_variable<true, false, true, false>,
+        &APTreeModel::calculate_criterion_one_variable<true, false, true, true>,
+        &APTreeModel::calculate_criterion_one_variable<true, true, false, false>,
+        &APTreeModel::calculate_criterion_one_variable<true, true, false, true>,
+        &APTreeModel::calculate_criterion_one_variable<true, true, true, false>,
+        &APTreeModel::calculate_criterion_one_variable<true, true, true, true>};
+
+    size_t index = (state.gram_loss ? 8 : 0) + (state.weighted_loss ? 4 : 0) + (state.abs_normalize ? 2 : 0) + (state.stop_no_gain ? 1 : 0);
+
+    return kernels[index];
+}
+
 void APTreeModel::calculate_criterion_APTree_TS(State &state, std::vector<APTree *> &bottom_nodes_vec, std::vector<bool> &node_splitability, size_t &split_node, size_t &split_var, size_t &split_point, bool &splitable)
 {
     size_t num_nodes = bottom_nodes_vec.size();
@@ -166,6 +306,16 @@ void APTreeModel::calculate_criterion_APTree_TS(State &state, std::vector<APTree
 
     size_t temp_index;
 
+    // month level inputs of the macro split are built once, every candidate is priced from them
+    if (this->month_macro.n_cols != state.first_split_var->n_elem)
+    {
+        this->initialize_month_macro(state);
+    }
+    if (this->ZZ_month.n_cols != state.num_months)
+    {
+        this->initialize_gram_matrix(state);
+    }
+
     for (size_t i = 0; i < num_nodes; i++)
     {
         if (!node_splitability[i])
@@ -177,7 +327,7 @@ void APTreeModel::calculate_criterion_APTree_TS(State &state, std::vector<APTree
             // this node is splitable, checkout split candidates
             // calculate sufficient statistics for a node
 
-            node_sufficient_stat(state, *(bottom_nodes_vec[i]->Xorder), weighted_return_all, cumu_weight_all, num_stocks_all);
+            node_sufficient_stat(state, bottom_nodes_vec[i], weighted_return_all, cumu_weight_all, num_stocks_all);
 
             // depth 1, root
             for (size_t var = 0; var < state.first_split_mat->n_cols; var++)
@@ -225,13 +375,12 @@ void APTreeModel::calculate_criterion_APTree_TS(State &state, std::vector<APTree
     return;
 }
 
-void APTreeModel::node_sufficient_stat(State &state, arma::umat &Xorder, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all)
+void APTreeModel::node_sufficient_stat(State &state, APTree *node, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all)
 {
     // This function create basis portfolio for the node
     // Use R not Y
-    size_t num_obs = Xorder.n_rows;
+    size_t num_obs = node->getN();
     size_t temp_index;
-    size_t temp_month;
     size_t temp_month_index;
 
     // three sufficient statistics
@@ -244,9 +393,8 @@ void APTreeModel::node_sufficient_stat(State &state, arma::umat &Xorder, arma::v
 
     for (size_t i = 0; i < num_obs; i++)
     {
-        temp_index = Xorder(i, 0);
-        temp_month = (*state.months)(temp_index);
-        temp_month_index = state.months_list->at(temp_month);
+        temp_index = node->Xorder_index(i, 0);
+        temp_month_index = (*state.month_index)[temp_index];
         weighted_return_all(temp_month_index) += (*state.R)(temp_index) * (*state.weight)(temp_index);
         cumu_weight_all(temp_month_index) += (*state.weight)(temp_index);
         num_stocks_all(temp_month_index) += 1.0;
@@ -255,7 +403,8 @@ void APTreeModel::node_sufficient_stat(State &state, arma::umat &Xorder, arma::v
     return;
 }
 
-void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all)
+template <bool gram_loss, bool weighted_loss, bool abs_normalize, bool stop_no_gain>
+void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, const mve_block &block, arma::mat &regressor, lm_workspace &lm_work)
 {
     // calculate split criterion for one variable at a specific node
     APTree *node = bottom_nodes_vec[node_ind];
@@ -268,113 +417,50 @@ void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std
     // second vector: cumulative weight
     // the portfolio is just elementwise ratio of the two vectors
     size_t num_nodes = bottom_nodes_vec.size();
-    arma::umat *Xorder = node->Xorder;
 
-    // calculate sufficient statistics of all data here
-    size_t temp_index = 0;
-    size_t temp_month = 0;
+    // sufficient statistics of the leaf and of the left side of every cutpoint, cached on the node
+    leaf_stat &stat = node->stat;
+
     size_t temp_month_index = 0;
 
-    // next loop over cutpoints, calculate sufficient statistics on left / right side
+    // sufficient statistics on left / right side of one cutpoint
     // basis porfolio, use R not Y
-    arma::vec weighted_return_left(state.num_months, arma::fill::zeros);
-    arma::vec cumu_weight_left(state.num_months, arma::fill::zeros);
-    arma::vec num_stocks_left(state.num_months, arma::fill::zeros);
+    arma::vec weighted_return_left;
+    arma::vec cumu_weight_left;
+    arma::vec num_stocks_left;
 
-    arma::vec weighted_return_right(state.num_months, arma::fill::zeros);
-    arma::vec cumu_weight_right(state.num_months, arma::fill::zeros);
-    arma::vec num_stocks_right(state.num_months, arma::fill::zeros);
+    arma::vec weighted_return_right;
+    arma::vec cumu_weight_right;
+    arma::vec num_stocks_right;
 
-    double cutpoint;
-    size_t loop_index = 0;
     arma::mat mu;
     arma::mat sigma;
     arma::mat weight;
-    arma::mat ft;
+    arma::vec ft;
     double weight_sum;
 
-    arma::mat all_portfolio(state.num_months, num_nodes + 1, arma::fill::zeros);
-    temp_index = 2; // the FIRST two columns for the candidate split
-    for (size_t i = 0; i < num_nodes; i++)
+    // portfolios of the candidate left / right children, the other leaves are read from leaf_portfolio
+    arma::mat candidate(state.num_months, 2, arma::fill::zeros);
+    arma::mat all_portfolio;
+    arma::vec weight_others(this->leaf_portfolio.n_cols);
+
+    if (stat.num_stocks_left[var].n_elem == 0)
     {
-        if (i != node_ind)
-        {
-            // if it is not the current node
-            // copy portfolio return from the leaf directly
-            for (size_t ind = 0; ind < state.num_months; ind++)
-            {
-                all_portfolio(ind, temp_index) = (bottom_nodes_vec[i]->theta)[ind];
-            }
-            temp_index++;
-        }
+        // first time this variable is evaluated at this leaf
+        this->cutpoint_sufficient_stat(state, node, var);
     }
 
     // next calculate portfolio returns for current candidate
     for (size_t i = 0; i < state.num_cutpoints; i++)
     {
-        // reset all vectors for a new cutpoint
-        weighted_return_left.fill(0.0);
-        weighted_return_right.fill(0.0);
-        cumu_weight_left.fill(0.0);
-        cumu_weight_right.fill(0.0);
-        num_stocks_left.fill(0.0);
-        num_stocks_right.fill(0.0);
-
-        // cout << "dim of all portfolio " << all_portfolio.n_rows << " " << all_portfolio.n_cols << endl;
-
-        // loop over candidates
-        cutpoint = state.split_candidates[i];
-
-        // while ((*state.X)((*Xorder)(loop_index, var), var) <= cutpoint)
-        // {
-        //     // the observation is on the left side
-        //     temp_index = (*Xorder)(loop_index, var);              // convert from sorted index (rank) to the original index
-        //     temp_month = (*state.months)(temp_index);             // find corresponding month
-        //     temp_month_index = state.months_list->at(temp_month); // index of the month in the month_list
-        //     // update weighted return, cumulative weight and count of stocks
-        //     weighted_return_left(temp_month_index) += (*state.R)(temp_index) * (*state.weight)(temp_index);
-        //     cumu_weight_left(temp_month_index) += (*state.weight)(temp_index);
-        //     num_stocks_left(temp_month_index) += 1.0;
-        //     loop_index++; // index of the current obs in the original Xorder matrix, will be used in the next round until it reaches total number of obs
-        //     if (loop_index == (*Xorder).n_rows)
-        //     {
-        //         // terminating condition, avoid overflow
-        //         break;
-        //     }
-        // }
-
-        // weighted_return_right = weighted_return_all - weighted_return_left;
-        // cumu_weight_right = cumu_weight_all - weighted_return_left;
-        // num_stocks_right = num_stocks_all - num_stocks_left;
-
-
-        for(size_t jj = 0; jj < (*Xorder).n_rows; jj ++)
-        {
-            if ((*state.X)((*Xorder)(jj, var), var) <= cutpoint)
-            {
-                temp_index = (*Xorder)(jj, var);                      // convert from sorted index (rank) to the original index
-                temp_month = (*state.months)(temp_index);             // find corresponding month
-                temp_month_index = state.months_list->at(temp_month); // index of the month in the month_list
-                // update weighted return, cumulative weight and count of stocks
-                weighted_return_left(temp_month_index) += (*state.R)(temp_index) * (*state.weight)(temp_index);
-                cumu_weight_left(temp_month_index) += (*state.weight)(temp_index);
-                num_stocks_left(temp_month_index) += 1.0;
-            }
-            else
-            {
-                temp_index = (*Xorder)(jj, var);                      // convert from sorted index (rank) to the original index
-                temp_month = (*state.months)(temp_index);             // find corresponding month
-                temp_month_index = state.months_list->at(temp_month); // index of the month in the month_list
-                // update weighted return, cumulative weight and count of stocks
-                weighted_return_right(temp_month_index) += (*state.R)(temp_index) * (*state.weight)(temp_index);
-                cumu_weight_right(temp_month_index) += (*state.weight)(temp_index);
-                num_stocks_right(temp_month_index) += 1.0;
-            }
-        }
+        weighted_return_left = stat.weighted_return_left[var].col(i);
+        cumu_weight_left = stat.cumu_weight_left[var].col(i);
+        num_stocks_left = stat.num_stocks_left[var].col(i);
 
-
-        // cout << " ---- " << endl;
-        // cout << arma::join_rows(num_stocks_all - num_stocks_left - num_stocks_right, weighted_return_all - weighted_return_left - weighted_return_right, cumu_weight_all - cumu_weight_left - cumu_weight_right) << endl;
+        // the right side is the leaf total minus the left side
+        weighted_return_right = stat.weighted_return_all - weighted_return_left;
+        cumu_weight_right = stat.cumu_weight_all - cumu_weight_left;
+        num_stocks_right = stat.num_stocks_all - num_stocks_left;
 
         // check stopping conditions such as minimal leaf size, number of stocks
         if (num_stocks_right.min() < state.min_leaf_size || num_stocks_left.min() < state.min_leaf_size || arma::accu(num_stocks_right) == 0 || arma::accu(num_stocks_left) == 0)
@@ -388,18 +474,40 @@ void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std
             for (size_t ind = 0; ind < state.num_months; ind++)
             {
                 // calculate weighted return for the candidate left / right child leaves
-                all_portfolio(ind, 0) = (num_stocks_left(ind) == 0) ? 0 : weighted_return_left(ind) / cumu_weight_left(ind);
-                all_portfolio(ind, 1) = (num_stocks_right(ind) == 0) ? 0 : weighted_return_right(ind) / cumu_weight_right(ind);
+                candidate(ind, 0) = (num_stocks_left(ind) == 0) ? 0 : weighted_return_left(ind) / cumu_weight_left(ind);
+                candidate(ind, 1) = (num_stocks_right(ind) == 0) ? 0 : weighted_return_right(ind) / cumu_weight_right(ind);
             }
 
-            mu = arma::mean(all_portfolio, 0); // 0 for column mean
-            mu = arma::trans(mu);              // transpose to column vectors
-            sigma = arma::cov(all_portfolio);
-
-            size_t n_leafs = mu.n_elem;
+            size_t n_leafs = num_nodes + 1;
 
-            // mean variance efficient weight
-            weight = arma::inv(sigma + state.lambda_cov * arma::eye(n_leafs, n_leafs)) * (mu + state.lambda_mean * arma::ones(mu.n_rows, mu.n_cols));
+            if (block.factorized)
+            {
+                // mean variance efficient weight, block update on the two candidate columns
+                if (!this->mve_weight(state, candidate, block, weight))
+                {
+                    // no solution, set criterion as infinity
+                    // the right side is not empty here, so skipping the break check below is fine
+                    output[i] = std::numeric_limits<double>::max();
+                    continue;
+                }
+            }
+            else
+            {
+                // the candidate columns first, then the other leaves in the order of block.others
+                all_portfolio = arma::join_rows(candidate, this->leaf_portfolio.cols(block.others));
+                mu = arma::mean(all_portfolio, 0); // 0 for column mean
+                mu = arma::trans(mu);              // transpose to column vectors
+                sigma = arma::cov(all_portfolio);
+
+                // mean variance efficient weight, sigma + lambda_cov * I is not positive definite here, so no inv_sympd
+                // no_approx, a singular system fails quietly instead of warning from a worker thread
+                if (!arma::solve(weight, sigma + state.lambda_cov * arma::eye(n_leafs, n_leafs), mu + state.lambda_mean * arma::ones(mu.n_rows, mu.n_cols), arma::solve_opts::no_approx))
+                {
+                    // no solution, set criterion as infinity
+                    output[i] = std::numeric_limits<double>::max();
+                    continue;
+                }
+            }
 
             arma::vec equal_weight(n_leafs);
 
@@ -407,7 +515,7 @@ void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std
 
             weight = weight * state.eta + (1.0 - state.eta) * equal_weight;
 
-            if (state.abs_normalize)
+            if (abs_normalize)
             {
                 weight_sum = arma::accu(arma::abs(weight));
             }
@@ -418,32 +526,46 @@ void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std
 
             weight = weight / weight_sum;
 
-            // mean variance efficient portfolio
-            ft = all_portfolio * weight;
-
-            for (size_t i = 0; i < state.num_obs_all; i++)
+            // mean variance efficient portfolio, the other leaves enter through their columns of leaf_portfolio
+            weight_others.zeros();
+            for (size_t j = 0; j < block.others.n_elem; j++)
             {
-                for (size_t j = 0; j < (*state.Z).n_cols; j++)
-                {
-                    // interaction term, Z_{it} * ft
-                    temp_month_index = state.months_list->at((*state.months)(i));
-                    this->regressor(i, j) = (*state.Z)(i, j) * ft(temp_month_index, 0);
-                }
+                weight_others(block.others(j)) = weight(j + 2, 0);
             }
+            ft = candidate * weight.rows(0, 1) + this->leaf_portfolio * weight_others;
 
-            if (state.weighted_loss)
+            if (gram_loss)
             {
-                // Loss function, Use Y instead of R
-                // pricing error of Y
-                output[i] = fastLm_weighted((*state.Y), this->regressor, (*state.loss_weight));
+                // same pricing error, assembled from month level Gram blocks
+                output[i] = this->calculate_loss_gram_mode<weighted_loss>(state, ft);
             }
             else
             {
-                // no weight on loss function, standard regression
-                output[i] = fastLm((*state.Y), this->regressor);
+                for (size_t i = 0; i < state.num_obs_all; i++)
+                {
+                    size_t row = state.obs(i);
+                    temp_month_index = (*state.month_index)[row];
+                    for (size_t j = 0; j < (*state.Z).n_cols; j++)
+                    {
+                        // interaction term, Z_{it} * ft
+                        regressor(i, j) = (*state.Z)(row, j) * ft(temp_month_index, 0);
+                    }
+                }
+
+                if (weighted_loss)
+                {
+                    // Loss function, Use Y instead of R
+                    // pricing error of Y
+                    output[i] = fastLm_weighted((*state.Y), regressor, (*state.loss_weight), lm_work);
+                }
+                else
+                {
+                    // no weight on loss function, standard regression
+                    output[i] = fastLm((*state.Y), regressor, lm_work);
+                }
             }
 
-            if (state.stop_no_gain)
+            if (stop_no_gain)
             {
                 // compare with overall loss, stop split if no gain
                 if (output[i] >= state.overall_loss)
@@ -454,213 +576,325 @@ void APTreeModel::calculate_criterion_one_variable(State &state, size_t var, std
             }
         }
 
-        if (loop_index == (*Xorder).n_rows)
+        if (arma::accu(num_stocks_right) == 0)
         {
-            // if loop_index = number of data, means that all observations belongs to left side
+            // all observations belongs to left side
             // not necessary to loop over the next larger cutpoint
             break;
         }
     }
 
+    if (!stat.keep_left)
+    {
+        // over the cache budget, only the task of this variable used them
+        stat.clear_left(var);
+    }
+
     return;
 }
 
-void APTreeModel::calculate_criterion_one_variable_APTree_TS(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all, size_t var_ind)
+void APTreeModel::initialize_mve_block(State &state, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, mve_block &block)
 {
-    // calculate split criterion for one variable at a specific node
-    APTree *node = bottom_nodes_vec[node_ind];
+    // the covariance of all_portfolio is [D B'; B C], the first two columns are the candidate split
+    // C and the mean of the other leaves do not change with the candidate, factorize them once here
+    size_t num_nodes = bottom_nodes_vec.size();
+    size_t temp_index = 0;
 
-    // initialize split criterion, start from infinity
-    std::fill(output.begin(), output.end(), std::numeric_limits<double>::max());
+    block.others.set_size(num_nodes - 1);
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        if (i != node_ind)
+        {
+            block.others(temp_index) = bottom_nodes_vec[i]->portfolio_col;
+            temp_index++;
+        }
+    }
 
-    // essentially, the sufficient statistics are two vectors with length num_months;
-    // first vector: weight * return
-    // second vector: cumulative weight
-    // the portfolio is just elementwise ratio of the two vectors
-    size_t num_nodes = bottom_nodes_vec.size();
-    arma::umat *Xorder = node->Xorder;
+    block.factorized = true;
+
+    if (num_nodes == 1)
+    {
+        // the root, no other leaves
+        return;
+    }
+
+    arma::mat others = this->leaf_portfolio.cols(block.others);
+    arma::mat mu = arma::trans(arma::mean(others, 0));
+    arma::mat sigma = arma::cov(others) + state.lambda_cov * arma::eye(num_nodes - 1, num_nodes - 1);
+
+    // upper triangular, sigma = chol_upper' * chol_upper
+    if (!arma::chol(block.chol_upper, sigma))
+    {
+        // not positive definite, fall back to the explicit inverse of the full covariance
+        block.factorized = false;
+        return;
+    }
+
+    block.solve_mu = arma::solve(arma::trimatu(block.chol_upper), arma::solve(arma::trimatl(arma::trans(block.chol_upper)), mu + state.lambda_mean * arma::ones(num_nodes - 1, 1)));
+
+    return;
+}
+
+bool APTreeModel::mve_weight(State &state, const arma::mat &candidate_portfolio, const mve_block &block, arma::mat &weight)
+{
+    // solve (sigma + lambda_cov * I) * weight = mu + lambda_mean by the Schur complement of C
+    // only the two candidate columns are new, so the cost per candidate is O(T * L) instead of O(L^3)
+    // false if a solve fails, it runs inside the parallel split search, so it must not throw
+    // the dense solves use no_approx, a singular system fails quietly instead of warning from a worker thread
+    arma::mat candidate = candidate_portfolio;
+    arma::mat mu = arma::trans(arma::mean(candidate, 0));
+    arma::mat D = arma::cov(candidate) + state.lambda_cov * arma::eye(2, 2);
+
+    for (size_t j = 0; j < 2; j++)
+    {
+        for (size_t ind = 0; ind < state.num_months; ind++)
+        {
+            candidate(ind, j) -= mu(j, 0);
+        }
+    }
+
+    mu = mu + state.lambda_mean * arma::ones(2, 1);
+
+    if (block.others.n_elem == 0)
+    {
+        // the root, the covariance is D itself
+        return arma::solve(weight, D, mu, arma::solve_opts::no_approx);
+    }
+
+    // the candidate is demeaned, so leaf_portfolio' * candidate is the cross covariance without demeaning the leaves
+    // the row of the node being split is dropped, the rest follow the order of block.others
+    arma::mat B_all = arma::trans(this->leaf_portfolio) * candidate / (double)(state.num_months - 1);
+    arma::mat B = B_all.rows(block.others);
+
+    // G = C^{-1} B by two triangular solves
+    arma::mat G;
+    arma::mat temp;
+    if (!arma::solve(temp, arma::trimatl(arma::trans(block.chol_upper)), B) || !arma::solve(G, arma::trimatu(block.chol_upper), temp))
+    {
+        return false;
+    }
+
+    // Schur complement of C, 2 * 2
+    arma::mat schur = D - arma::trans(B) * G;
+
+    arma::mat weight_candidate;
+    if (!arma::solve(weight_candidate, schur, mu - arma::trans(B) * block.solve_mu, arma::solve_opts::no_approx))
+    {
+        return false;
+    }
+    arma::mat weight_others = block.solve_mu - G * weight_candidate;
 
-    // // calculate sufficient statistics of all data here
+    weight = arma::join_cols(weight_candidate, weight_others);
+
+    return true;
+}
+
+void APTreeModel::cutpoint_sufficient_stat(State &state, APTree *node, size_t var)
+{
+    // sufficient statistics on the left side of every cutpoint of one variable at a leaf
+    // column var of Xorder is sorted by the split variable, and cutpoints are increasing
+    // so one monotone sweep over the node is enough for all cutpoints
+    // the left sums are cumulative, column i collects all data with X <= split_candidates[i]
+    size_t num_obs = node->getN();
     size_t temp_index;
-    size_t temp_month;
     size_t temp_month_index;
+    size_t loop_index = 0;
+    double cutpoint;
 
-    // next loop over cutpoints, calculate sufficient statistics on left / right side
     arma::vec weighted_return_left(state.num_months, arma::fill::zeros);
     arma::vec cumu_weight_left(state.num_months, arma::fill::zeros);
     arma::vec num_stocks_left(state.num_months, arma::fill::zeros);
 
-    arma::vec weighted_return_right(state.num_months, arma::fill::zeros);
-    arma::vec cumu_weight_right(state.num_months, arma::fill::zeros);
-    arma::vec num_stocks_right(state.num_months, arma::fill::zeros);
-
-    double cutpoint;
-    size_t loop_index = 0;
-    arma::mat mu;
-    arma::mat sigma;
-    arma::mat weight;
-    arma::mat ft;
-    double weight_sum;
-
-    // for time series split, the months on the left / right sides are not the same
-    size_t num_months_left = 0;
-    size_t num_months_right = 0;
-
-    // number of original data observations on the left / right side
-    size_t num_obs_left = 0;
-    size_t num_obs_right = 0;
+    arma::mat &weighted_return_mat = node->stat.weighted_return_left[var];
+    arma::mat &cumu_weight_mat = node->stat.cumu_weight_left[var];
+    arma::mat &num_stocks_mat = node->stat.num_stocks_left[var];
+    weighted_return_mat.set_size(state.num_months, state.num_cutpoints);
+    cumu_weight_mat.set_size(state.num_months, state.num_cutpoints);
+    num_stocks_mat.set_size(state.num_months, state.num_cutpoints);
 
-    arma::mat all_portfolio(state.num_months, num_nodes + 1, arma::fill::zeros);
-    temp_index = 2; // first two columns for the candidate split
-
-    for (size_t i = 0; i < num_nodes; i++)
+    if (state.bin_code->n_elem > 0)
     {
-        if (i != node_ind)
+        // histogram of the leaf over (month, bin) from the precomputed bin codes, X and the sort order are not needed
+        // the left side of cutpoint i is the cumulative sum of bins 0, ..., i
+        arma::mat weighted_return_hist(state.num_months, state.num_cutpoints + 1, arma::fill::zeros);
+        arma::mat cumu_weight_hist(state.num_months, state.num_cutpoints + 1, arma::fill::zeros);
+        arma::mat num_stocks_hist(state.num_months, state.num_cutpoints + 1, arma::fill::zeros);
+        size_t bin;
+
+        for (size_t j = 0; j < num_obs; j++)
         {
-            for (size_t ind = 0; ind < state.num_months; ind++)
-            {
-                all_portfolio(ind, temp_index) = (bottom_nodes_vec[i]->theta)[ind];
-            }
-            temp_index++;
+            temp_index = node->Xorder_index(j, 0);
+            temp_month_index = (*state.month_index)[temp_index];
+            bin = (*state.bin_code)(temp_index, var);
+            weighted_return_hist(temp_month_index, bin) += (*state.R)(temp_index) * (*state.weight)(temp_index);
+            cumu_weight_hist(temp_month_index, bin) += (*state.weight)(temp_index);
+            num_stocks_hist(temp_month_index, bin) += 1.0;
         }
+
+        for (size_t i = 0; i < state.num_cutpoints; i++)
+        {
+            weighted_return_left += weighted_return_hist.col(i);
+            cumu_weight_left += cumu_weight_hist.col(i);
+            num_stocks_left += num_stocks_hist.col(i);
+
+            weighted_return_mat.col(i) = weighted_return_left;
+            cumu_weight_mat.col(i) = cumu_weight_left;
+            num_stocks_mat.col(i) = num_stocks_left;
+        }
+
+        return;
     }
 
+    // no bin codes, sweep the sorted column instead
     for (size_t i = 0; i < state.num_cutpoints; i++)
     {
-        // reset all vectors for a new cutpoint
-        weighted_return_left.fill(0.0);
-        weighted_return_right.fill(0.0);
-        cumu_weight_left.fill(0.0);
-        cumu_weight_right.fill(0.0);
-        num_stocks_left.fill(0.0);
-        num_stocks_right.fill(0.0);
-
-        cutpoint = (*state.first_split_mat)(i, var_ind);
+        cutpoint = state.split_candidates[i];
 
-        while ((*state.X)((*Xorder)(loop_index, var), var) <= cutpoint)
+        while (loop_index < num_obs && (*state.X)(node->Xorder_index(loop_index, var), var) <= cutpoint)
         {
             // the observation is on the left side
-            temp_index = (*Xorder)(loop_index, var);
-            temp_month = (*state.months)(temp_index);
-            temp_month_index = state.months_list->at(temp_month);
+            temp_index = node->Xorder_index(loop_index, var);   // convert from sorted index (rank) to the original index
+            temp_month_index = (*state.month_index)[temp_index]; // index of the month in the month_list
+            // update weighted return, cumulative weight and count of stocks
             weighted_return_left(temp_month_index) += (*state.R)(temp_index) * (*state.weight)(temp_index);
             cumu_weight_left(temp_month_index) += (*state.weight)(temp_index);
             num_stocks_left(temp_month_index) += 1.0;
-            loop_index++;
-            if (loop_index == (*Xorder).n_rows)
-            {
-                // terminating condition, avoid overflow
-                break;
-            }
+            loop_index++; // index of the current obs in the sorted column, the next cutpoint continues from here
         }
 
-        weighted_return_right = weighted_return_all - weighted_return_left;
-        cumu_weight_right = cumu_weight_all - cumu_weight_left;
-        num_stocks_right = num_stocks_all - num_stocks_left;
+        weighted_return_mat.col(i) = weighted_return_left;
+        cumu_weight_mat.col(i) = cumu_weight_left;
+        num_stocks_mat.col(i) = num_stocks_left;
+    }
 
-        // cout << "some conditions " << endl;
-        // cout << (!state.flag_first_cut) << endl;
-        // cout << (num_stocks_right.min() < state.min_leaf_size) << endl;
-        // cout << (num_stocks_left.min() < state.min_leaf_size) << endl;
-        // cout << (arma::accu(num_stocks_right) == 0) << endl;
-        // cout << (arma::accu(num_stocks_left) == 0) << endl;
+    return;
+}
 
-        if ((!state.flag_first_cut) && (num_stocks_right.min() < state.min_leaf_size || num_stocks_left.min() < state.min_leaf_size || arma::accu(num_stocks_right) == 0 || arma::accu(num_stocks_left) == 0))
-        {
-            // too few data in the leaf
-            output[i] = std::numeric_limits<double>::max();
-        }
-        else
-        {
+void APTreeModel::initialize_month_macro(State &state)
+{
+    // value of every first split variable in every month, a macro variable is the same for all stocks of a month
+    // NaN marks a month where the variable is not constant, the criterion then walks the rows of the node instead
+    size_t num_vars = state.first_split_var->n_elem;
+    size_t temp_month_index;
+    size_t var;
+    double x;
 
-            for (size_t ind = 0; ind < state.num_months; ind++)
-            {
-                // first column for the left portfolio
-                all_portfolio(ind, 0) = (cumu_weight_left(ind) == 0) ? 0 : weighted_return_left(ind) / cumu_weight_left(ind);
+    arma::Mat<uint8_t> seen(state.num_months, num_vars, arma::fill::zeros);
+    this->month_macro.set_size(state.num_months, num_vars);
+    this->month_macro.fill(arma::datum::nan);
 
-                // second column for the right portfolio
-                all_portfolio(ind, 1) = (cumu_weight_right(ind) == 0) ? 0 : weighted_return_right(ind) / cumu_weight_right(ind);
+    for (size_t k = 0; k < state.num_obs_all; k++)
+    {
+        size_t i = state.obs(k);
+        temp_month_index = (*state.month_index)[i];
+        for (size_t v = 0; v < num_vars; v++)
+        {
+            var = (size_t)(*state.first_split_var)(v);
+            x = (*state.X)(i, var);
+            if (!seen(temp_month_index, v))
+            {
+                this->month_macro(temp_month_index, v) = x;
+                seen(temp_month_index, v) = 1;
             }
-
-            // count how many months on the left
-            num_months_left = 0;
-            for (size_t tt = 0; tt < num_stocks_left.n_elem; tt++)
+            else if (this->month_macro(temp_month_index, v) != x)
             {
-                if (num_stocks_left[tt] == 0)
-                {
-                    num_months_left++;
-                }
+                this->month_macro(temp_month_index, v) = arma::datum::nan;
             }
-            num_months_right = state.num_months - num_months_left;
+        }
+    }
 
-            // cout << "number of months on left " << num_months_left << " " << num_months_right << endl;
+    return;
+}
 
-            mu = arma::mean(all_portfolio, 0); // 0 for column mean
-            mu = arma::trans(mu);              // transpose to column vectors
-            sigma = arma::cov(all_portfolio);
+void APTreeModel::calculate_criterion_one_variable_APTree_TS(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all, size_t var_ind)
+{
+    // calculate split criterion for one macro variable at a specific node
+    // a macro split sends whole months to one side, so a candidate only needs the month level sums of the node
+    // and the month level Gram blocks of the pricing regression, the cost per cutpoint is O(T) plus a small solve
+    APTree *node = bottom_nodes_vec[node_ind];
 
-            size_t n_leafs = mu.n_elem;
+    // initialize split criterion, start from infinity
+    std::fill(output.begin(), output.end(), std::numeric_limits<double>::max());
 
-            weight = arma::inv(sigma + state.lambda * arma::eye(n_leafs, n_leafs)) * mu;
+    size_t num_obs = node->getN();
 
-            arma::vec equal_weight(n_leafs);
+    size_t temp_index;
+    size_t temp_month_index;
 
-            equal_weight.fill(1.0 / n_leafs);
+    // sufficient statistics on the left side are cumulative over cutpoints, the right side is all minus left
+    arma::vec weighted_return_left(state.num_months, arma::fill::zeros);
+    arma::vec cumu_weight_left(state.num_months, arma::fill::zeros);
+    arma::vec num_stocks_left(state.num_months, arma::fill::zeros);
 
-            weight = weight * state.eta + (1.0 - state.eta) * equal_weight;
+    arma::vec weighted_return_right(state.num_months, arma::fill::zeros);
+    arma::vec cumu_weight_right(state.num_months, arma::fill::zeros);
+    arma::vec num_stocks_right(state.num_months, arma::fill::zeros);
 
-            if (state.abs_normalize)
-            {
-                weight_sum = arma::accu(arma::abs(weight));
-            }
-            else
-            {
-                weight_sum = arma::accu((weight));
-            }
-            weight = weight / weight_sum;
+    // the variable is constant within every month, months are sent left as a whole without touching the rows
+    bool month_level = !arma::vec(this->month_macro.col(var_ind)).has_nan();
 
-            ft = all_portfolio * weight;
+    double cutpoint;
+    size_t loop_index = 0;
+    arma::vec month_portfolio(state.num_months);
 
-            num_obs_left = num_obs_right = 0;
+    for (size_t i = 0; i < state.num_cutpoints; i++)
+    {
+        cutpoint = (*state.first_split_mat)(i, var_ind);
 
-            for (size_t i = 0; i < state.num_obs_all; i++)
+        if (month_level)
+        {
+            loop_index = 0;
+            for (size_t tt = 0; tt < state.num_months; tt++)
             {
-                for (size_t j = 0; j < (*state.Z).n_cols; j++)
+                if (num_stocks_all(tt) > 0 && this->month_macro(tt, var_ind) <= cutpoint)
                 {
-                    temp_month_index = state.months_list->at((*state.months)(i));
-
-                    if (num_stocks_left(temp_month_index) == 0)
-                    {
-                        // no stock in the left leaf, look at the right one
-                        this->regressor(i, j) = (*state.Z)(i, j) * all_portfolio(temp_month_index, 1);
-                        num_obs_right++;
-                    }
-                    else
-                    {
-                        // have stocks in the left leaf, empty at the right one
-                        this->regressor(i, j) = (*state.Z)(i, j) * all_portfolio(temp_month_index, 0);
-                        num_obs_left++;
-                    }
+                    weighted_return_left(tt) = weighted_return_all(tt);
+                    cumu_weight_left(tt) = cumu_weight_all(tt);
+                    num_stocks_left(tt) = num_stocks_all(tt);
+                    loop_index += (size_t)num_stocks_all(tt);
                 }
             }
-
-            size_t num_obs_left = loop_index;
-            size_t num_obs_right = state.num_obs_all - num_obs_left;
-            size_t num_regressor_cols = this->regressor.n_cols;
-
-            arma::vec Y_left(num_obs_left);
-            arma::vec Y_right(num_obs_right);
-            arma::mat regressor_left(num_obs_left, num_regressor_cols);
-            arma::mat regressor_right(num_obs_right, num_regressor_cols);
-
-            if (state.weighted_loss)
+        }
+        else
+        {
+            // the variable changes within a month, walk the sorted column of the node
+            while (loop_index < num_obs && (*state.X)(node->Xorder_index(loop_index, var), var) <= cutpoint)
             {
-                output[i] = fastLm_weighted((*state.Y), this->regressor, (*state.loss_weight));
+                // the observation is on the left side
+                temp_index = node->Xorder_index(loop_index, var);
+                temp_month_index = (*state.month_index)[temp_index];
+                weighted_return_left(temp_month_index) += (*state.R)(temp_index) * (*state.weight)(temp_index);
+                cumu_weight_left(temp_month_index) += (*state.weight)(temp_index);
+                num_stocks_left(temp_month_index) += 1.0;
+                loop_index++;
             }
-            else
+        }
+
+        weighted_return_right = weighted_return_all - weighted_return_left;
+        cumu_weight_right = cumu_weight_all - cumu_weight_left;
+        num_stocks_right = num_stocks_all - num_stocks_left;
+
+        // the per month leaf size does not apply to the macro split, but each side needs at least one month
+        if (arma::accu(num_stocks_right) == 0 || arma::accu(num_stocks_left) == 0 || ((!state.flag_first_cut) && (num_stocks_right.min() < state.min_leaf_size || num_stocks_left.min() < state.min_leaf_size)))
+        {
+            // too few data in the leaf
+            output[i] = std::numeric_limits<double>::max();
+        }
+        else
+        {
+            // a month is either on the left or the right, it is priced by the portfolio of its side
+            for (size_t tt = 0; tt < state.num_months; tt++)
             {
-                output[i] = fastLm((*state.Y), this->regressor);
+                if (num_stocks_left(tt) == 0)
+                {
+                    month_portfolio(tt) = (cumu_weight_right(tt) == 0) ? 0 : weighted_return_right(tt) / cumu_weight_right(tt);
+                }
+                else
+                {
+                    month_portfolio(tt) = (cumu_weight_left(tt) == 0) ? 0 : weighted_return_left(tt) / cumu_weight_left(tt);
+                }
             }
+            output[i] = this->calculate_loss_gram(state, month_portfolio);
 
             if (state.stop_no_gain)
             {
@@ -673,7 +907,7 @@ void APTreeModel::calculate_criterion_one_variable_APTree_TS(State &state, size_
             }
         }
 
-        if (loop_index == (*Xorder).n_rows)
+        if (loop_index == num_obs)
         {
             // if loop_index = number of data, means that all observations belongs to left side
             // not necessary to loop over the next larger cutpoint
@@ -687,7 +921,6 @@ void APTreeModel::calculate_criterion_one_variable_APTree_TS(State &state, size_
 void APTreeModel::split_node_APTree_TS(State &state, APTree *node, size_t split_var, size_t split_point)
 {
     // first, figure out how many are on the left side and right side
-    arma::umat *Xorder = node->Xorder;
     size_t num_obs_left = 0;
     size_t num_obs_right = 0;
 
@@ -703,7 +936,7 @@ void APTreeModel::split_node_APTree_TS(State &state, APTree *node, size_t split_
 
     for (size_t i = 0; i < node->getN(); i++)
     {
-        ((*state.X)((*Xorder)(i, split_var), split_var) <= (*state.first_split_mat)(split_point, var)) ? num_obs_left++ : num_obs_right++;
+        ((*state.X)(node->Xorder_index(i, split_var), split_var) <= (*state.first_split_mat)(split_point, var)) ? num_obs_left++ : num_obs_right++;
     }
 
     double temp_split = (*state.first_split_mat)(split_point, var);
@@ -712,17 +945,23 @@ void APTreeModel::split_node_APTree_TS(State &state, APTree *node, size_t split_
     node->setc_index(split_point);
     node->setc(temp_split);
 
-    arma::umat *Xorder_left = new arma::umat(num_obs_left, state.p, arma::fill::zeros);
-    arma::umat *Xorder_right = new arma::umat(num_obs_right, state.p, arma::fill::zeros);
-
-    // node->split_Xorder((*Xorder_left), (*Xorder_right), (*Xorder), split_point, split_var, state);
+    // the macro cutpoints are not the split candidates, compare with X directly
+    node->split_Xorder(split_var, split_point, temp_split, false, state);
 
-    APTree::APTree_p lchild = new APTree(state.num_months, node->getdepth() + 1, num_obs_left, node->getID() * 2, node, Xorder_left);
-    APTree::APTree_p rchild = new APTree(state.num_months, node->getdepth() + 1, num_obs_right, node->getID() * 2 + 1, node, Xorder_right);
+    // children share the Xorder of the parent, left rows first, and live in the arena of the tree
+    // theta is left empty while growing, the left child takes over the portfolio column of the parent
+    APTree::APTree_p lchild = node->get_arena()->make(0, node->getdepth() + 1, num_obs_left, node->getID() * 2, node, node->Xorder, node->Xorder_begin);
+    APTree::APTree_p rchild = node->get_arena()->make(0, node->getdepth() + 1, num_obs_right, node->getID() * 2 + 1, node, node->Xorder, node->Xorder_begin + num_obs_left);
+    lchild->portfolio_col = node->portfolio_col;
+    rchild->portfolio_col = this->leaf_portfolio.n_cols;
 
     node->setl(lchild);
     node->setr(rchild);
 
+    // the node is no longer a leaf, drop its cached sufficient statistics and theta
+    node->stat.clear();
+    std::vector<double>().swap(node->theta);
+
     this->initialize_portfolio(state, lchild);
     this->initialize_portfolio(state, rchild);
 
@@ -732,12 +971,18 @@ void APTreeModel::split_node_APTree_TS(State &state, APTree *node, size_t split_
 void APTreeModel::split_node(State &state, APTree *node, size_t split_var, size_t split_point)
 {
     // first, figure out how many are on the left side and right side
-    arma::umat *Xorder = node->Xorder;
     size_t num_obs_left = 0;
     size_t num_obs_right = 0;
     for (size_t i = 0; i < node->getN(); i++)
     {
-        ((*state.X)((*Xorder)(i, split_var), split_var) <= state.split_candidates[split_point]) ? num_obs_left++ : num_obs_right++;
+        if (state.bin_code->n_elem > 0)
+        {
+            ((*state.bin_code)(node->Xorder_index(i, split_var), split_var) <= split_point) ? num_obs_left++ : num_obs_right++;
+        }
+        else
+        {
+            ((*state.X)(node->Xorder_index(i, split_var), split_var) <= state.split_candidates[split_point]) ? num_obs_left++ : num_obs_right++;
+        }
     }
 
     double temp_split = state.split_candidates[split_point];
@@ -746,17 +991,22 @@ void APTreeModel::split_node(State &state, APTree *node, size_t split_var, size_
     node->setc_index(split_point);
     node->setc(temp_split);
 
-    arma::umat *Xorder_left = new arma::umat(num_obs_left, state.p, arma::fill::zeros);
-    arma::umat *Xorder_right = new arma::umat(num_obs_right, state.p, arma::fill::zeros);
-
-    node->split_Xorder((*Xorder_left), (*Xorder_right), (*Xorder), split_point, split_var, state);
+    node->split_Xorder(split_var, split_point, temp_split, state.bin_code->n_elem > 0, state);
 
-    APTree::APTree_p lchild = new APTree(state.num_months, node->getdepth() + 1, num_obs_left, node->getID() * 2, node, Xorder_left);
-    APTree::APTree_p rchild = new APTree(state.num_months, node->getdepth() + 1, num_obs_right, node->getID() * 2 + 1, node, Xorder_right);
+    // children share the Xorder of the parent, left rows first, and live in the arena of the tree
+    // theta is left empty while growing, the left child takes over the portfolio column of the parent
+    APTree::APTree_p lchild = node->get_arena()->make(0, node->getdepth() + 1, num_obs_left, node->getID() * 2, node, node->Xorder, node->Xorder_begin);
+    APTree::APTree_p rchild = node->get_arena()->make(0, node->getdepth() + 1, num_obs_right, node->getID() * 2 + 1, node, node->Xorder, node->Xorder_begin + num_obs_left);
+    lchild->portfolio_col = node->portfolio_col;
+    rchild->portfolio_col = this->leaf_portfolio.n_cols;
 
     node->setl(lchild);
     node->setr(rchild);
 
+    // the node is no longer a leaf, drop its cached sufficient statistics and theta
+    node->stat.clear();
+    std::vector<double>().swap(node->theta);
+
     this->initialize_portfolio(state, lchild);
     this->initialize_portfolio(state, rchild);
 
@@ -767,39 +1017,25 @@ void APTreeModel::initialize_portfolio(State &state, APTree *node)
 {
     // initialize Rt at the given node
     // calculate equal weight / value weight portfolio return of a node
-    size_t num_obs = (*node->Xorder).n_rows;
-    size_t month;
+    size_t num_obs = node->getN();
     size_t row_ind;
-    size_t temp_month_index;
-    std::vector<double> weight_sum(state.num_months);
+    portfolio_accumulator accumulator(state.num_months, 1);
+    arma::mat portfolio;
 
-    if (state.equal_weight)
-    {
-        for (size_t i = 0; i < num_obs; i++)
-        {
-            row_ind = (*node->Xorder)(i, 0);
-            month = (*state.months)[row_ind];
-            temp_month_index = state.months_list->at(month);
-            (node->theta)[temp_month_index] += (*state.R)[row_ind];
-            weight_sum[temp_month_index] = weight_sum[temp_month_index] + 1;
-        }
-    }
-    else
+    for (size_t i = 0; i < num_obs; i++)
     {
-        for (size_t i = 0; i < num_obs; i++)
-        {
-            row_ind = (*node->Xorder)(i, 0);
-            month = (*state.months)[row_ind];
-            temp_month_index = state.months_list->at(month);
-            (node->theta)[temp_month_index] += (*state.R)[row_ind] * (*state.weight)[row_ind];
-            weight_sum[temp_month_index] = weight_sum[temp_month_index] + (*state.weight)[row_ind];
-        }
+        row_ind = node->Xorder_index(i, 0);
+        accumulator.add((*state.month_index)[row_ind], 0, (*state.R)[row_ind], state.equal_weight ? 1.0 : (*state.weight)[row_ind]);
     }
 
-    for (size_t i = 0; i < state.num_months; i++)
+    accumulator.finalize(portfolio);
+
+    if (node->portfolio_col >= this->leaf_portfolio.n_cols)
     {
-        (node->theta)[i] = (weight_sum[i] == 0) ? 0.0 : (node->theta)[i] / weight_sum[i];
+        // a new leaf, its column is appended
+        this->leaf_portfolio.resize(state.num_months, node->portfolio_col + 1);
     }
+    this->leaf_portfolio.col(node->portfolio_col) = portfolio.col(0);
 
     return;
 }
@@ -816,6 +1052,13 @@ void APTreeModel::initialize_regressor_matrix(State &state)
     size_t num_H = (*state.H).n_cols;
     size_t num_Z = (*state.Z).n_cols;
 
+    if (state.gram_loss)
+    {
+        // the criterion works on month level blocks only, no need for the N-row regressor
+        this->initialize_gram_matrix(state);
+        return;
+    }
+
     if (state.no_H)
     {
         this->regressor.resize(num_obs, num_Z);
@@ -832,21 +1075,227 @@ void APTreeModel::initialize_regressor_matrix(State &state)
             for (size_t j = 0; j < num_H; j++)
             {
                 // first columns leave for the SDF
-                this->regressor(i, j + num_Z) = (*state.H)(i, j);
+                this->regressor(i, j + num_Z) = (*state.H)(state.obs(i), j);
+            }
+        }
+    }
+
+    // workspaces of the extra threads of the parallel split search, their regressors are allocated during the search
+    this->thread_lm_work.assign(state.num_threads - 1, lm_workspace());
+
+    return;
+}
+
+void APTreeModel::initialize_gram_matrix(State &state)
+{
+    // accumulate Z_t' Z_t, Z_t' H_t and Z_t' Y_t for every month, and the H blocks over all data
+    // the regressor of the criterion is [Z_t * ft, H_t], ft is a scalar in month t
+    // so X'X and X'Y of any candidate are weighted sums of these blocks
+    size_t num_Z = (*state.Z).n_cols;
+    size_t num_H = state.no_H ? 0 : (*state.H).n_cols;
+    size_t temp_month_index;
+    double y;
+    double z;
+    double w;
+
+    this->ZZ_month.zeros(num_Z * num_Z, state.num_months);
+    this->ZH_month.zeros(num_Z * num_H, state.num_months);
+    this->ZY_month.zeros(num_Z, state.num_months);
+    this->HH.zeros(num_H, num_H);
+    this->HY.zeros(num_H);
+    this->YY = 0.0;
+
+    if (state.weighted_loss)
+    {
+        this->ZZ_month_weighted.zeros(num_Z * num_Z, state.num_months);
+        this->ZH_month_weighted.zeros(num_Z * num_H, state.num_months);
+        this->ZY_month_weighted.zeros(num_Z, state.num_months);
+        this->HH_weighted.zeros(num_H, num_H);
+        this->HY_weighted.zeros(num_H);
+        this->YY_weighted = 0.0;
+    }
+
+    for (size_t k = 0; k < state.num_obs_all; k++)
+    {
+        // Y and loss_weight are indexed by position, the rest by row of the data
+        size_t i = state.obs(k);
+        temp_month_index = (*state.month_index)[i];
+        y = (*state.Y)(k);
+        w = state.weighted_loss ? (*state.loss_weight)(k) : 1.0;
+
+        for (size_t a = 0; a < num_Z; a++)
+        {
+            z = (*state.Z)(i, a);
+            this->ZY_month(a, temp_month_index) += z * y;
+            for (size_t b = 0; b < num_Z; b++)
+            {
+                this->ZZ_month(a + b * num_Z, temp_month_index) += z * (*state.Z)(i, b);
+            }
+            for (size_t h = 0; h < num_H; h++)
+            {
+                this->ZH_month(a + h * num_Z, temp_month_index) += z * (*state.H)(i, h);
+            }
+
+            if (state.weighted_loss)
+            {
+                this->ZY_month_weighted(a, temp_month_index) += w * z * y;
+                for (size_t b = 0; b < num_Z; b++)
+                {
+                    this->ZZ_month_weighted(a + b * num_Z, temp_month_index) += w * z * (*state.Z)(i, b);
+                }
+                for (size_t h = 0; h < num_H; h++)
+                {
+                    this->ZH_month_weighted(a + h * num_Z, temp_month_index) += w * z * (*state.H)(i, h);
+                }
             }
         }
+
+        for (size_t g = 0; g < num_H; g++)
+        {
+            this->HY(g) += (*state.H)(i, g) * y;
+            for (size_t h = 0; h < num_H; h++)
+            {
+                this->HH(g, h) += (*state.H)(i, g) * (*state.H)(i, h);
+            }
+
+            if (state.weighted_loss)
+            {
+                this->HY_weighted(g) += w * (*state.H)(i, g) * y;
+                for (size_t h = 0; h < num_H; h++)
+                {
+                    this->HH_weighted(g, h) += w * (*state.H)(i, g) * (*state.H)(i, h);
+                }
+            }
+        }
+
+        this->YY += y * y;
+        if (state.weighted_loss)
+        {
+            this->YY_weighted += w * y * y;
+        }
+    }
+
+    return;
+}
+
+template <typename mat_type, typename vec_type>
+void APTreeModel::assemble_gram_matrix(State &state, const arma::vec &ft, bool weighted, mat_type &XtX, vec_type &XtY)
+{
+    // X'X and X'Y of the regressor [Z_t * ft, H_t] from the month level blocks
+    // cost is O(T * k^2), independent of the number of observations
+    size_t num_Z = (*state.Z).n_cols;
+    size_t num_H = state.no_H ? 0 : (*state.H).n_cols;
+    size_t k = num_Z + num_H;
+
+    arma::mat &ZZ = weighted ? this->ZZ_month_weighted : this->ZZ_month;
+    arma::mat &ZH = weighted ? this->ZH_month_weighted : this->ZH_month;
+    arma::mat &ZY = weighted ? this->ZY_month_weighted : this->ZY_month;
+    arma::mat &HHmat = weighted ? this->HH_weighted : this->HH;
+    arma::vec &HYvec = weighted ? this->HY_weighted : this->HY;
+
+    arma::vec ZZ_sum = ZZ * arma::square(ft);
+    arma::vec ZH_sum = ZH * ft;
+    arma::vec ZY_sum = ZY * ft;
+
+    // no-op for the fixed size types, k matches their size
+    XtX.set_size(k, k);
+    XtY.set_size(k);
+
+    for (size_t a = 0; a < num_Z; a++)
+    {
+        XtY(a) = ZY_sum(a);
+        for (size_t b = 0; b < num_Z; b++)
+        {
+            XtX(a, b) = ZZ_sum(a + b * num_Z);
+        }
+        for (size_t h = 0; h < num_H; h++)
+        {
+            XtX(a, num_Z + h) = ZH_sum(a + h * num_Z);
+            XtX(num_Z + h, a) = ZH_sum(a + h * num_Z);
+        }
     }
+
+    for (size_t g = 0; g < num_H; g++)
+    {
+        XtY(num_Z + g) = HYvec(g);
+        for (size_t h = 0; h < num_H; h++)
+        {
+            XtX(num_Z + g, num_Z + h) = HHmat(g, h);
+        }
+    }
+
     return;
 }
 
-void APTreeModel::predict_AP(arma::mat &X, APTree &root, arma::vec &months, arma::vec &leaf_index)
+double APTreeModel::calculate_loss_gram(State &state, const arma::vec &ft)
+{
+    // sum of squared residuals of Yt ~ Zt * ft + Ht, same quantity as fastLm / fastLm_weighted
+    if (state.weighted_loss)
+    {
+        return this->calculate_loss_gram_mode<true>(state, ft);
+    }
+    return this->calculate_loss_gram_mode<false>(state, ft);
+}
+
+template <bool weighted_loss>
+double APTreeModel::calculate_loss_gram_mode(State &state, const arma::vec &ft)
 {
-    APTree *leaf;
-    for (size_t i = 0; i < X.n_rows; i++)
+    // fixed size normal equations for up to 4 regressors
+    size_t k = (*state.Z).n_cols + (state.no_H ? 0 : (*state.H).n_cols);
+
+    switch (k)
+    {
+    case 1:
+        return this->solve_loss_gram<weighted_loss, 1>(state, ft);
+    case 2:
+        return this->solve_loss_gram<weighted_loss, 2>(state, ft);
+    case 3:
+        return this->solve_loss_gram<weighted_loss, 3>(state, ft);
+    case 4:
+        return this->solve_loss_gram<weighted_loss, 4>(state, ft);
+    default:
+        return this->solve_loss_gram<weighted_loss, 0>(state, ft);
+    }
+}
+
+template <bool weighted_loss, size_t K>
+double APTreeModel::solve_loss_gram(State &state, const arma::vec &ft)
+{
+    // coefficients come from the normal equations, RSS = Y'Y - 2 b'X'Y + b'X'X b
+    typename gram_types<K>::mat_type XtX;
+    typename gram_types<K>::vec_type XtY;
+    typename gram_types<K>::vec_type coef;
+
+    this->assemble_gram_matrix(state, ft, false, XtX, XtY);
+
+    if (!arma::solve(coef, XtX, XtY, arma::solve_opts::no_approx))
+    {
+        // singular, e.g. ft is zero in every month, fastLm takes a least squares solution then
+        // the minimum norm one from the pseudo inverse has the same residuals, no_approx keeps worker threads from warning
+        arma::mat XtX_pinv;
+        if (!arma::pinv(XtX_pinv, arma::mat(XtX)))
+        {
+            // no solution, same as a failed fastLm
+            return std::numeric_limits<double>::max();
+        }
+        coef = XtX_pinv * XtY;
+    }
+
+    if (weighted_loss)
     {
-        leaf = root.bn(X, i);
-        leaf_index(i) = leaf->nid();
+        // fastLm_weighted fits the unweighted regression, then weights the squared residuals
+        this->assemble_gram_matrix(state, ft, true, XtX, XtY);
+        return this->YY_weighted - 2.0 * arma::dot(coef, XtY) + arma::as_scalar(coef.t() * XtX * coef);
     }
+
+    return this->YY - 2.0 * arma::dot(coef, XtY) + arma::as_scalar(coef.t() * XtX * coef);
+}
+
+void APTreeModel::predict_AP(const arma::mat &X, APTree &root, const arma::vec &months, arma::vec &leaf_index)
+{
+    // flatten once, then every row is a loop over a contiguous array
+    APTree_flat flat(root);
+    flat.predict(X, leaf_index);
     return;
 }
 
@@ -865,10 +1314,10 @@ void APTreeModel::calculate_factor(APTree &root, arma::vec &leaf_node_index, arm
     for (size_t i = 0; i < bottom_nodes_vec.size(); i++)
     {
         leaf_node_index(i) = bottom_nodes_vec[i]->nid();
-        for (size_t j = 0; j < state.num_months; j++)
-        {
-            all_leaf_portfolio(j, i) = (bottom_nodes_vec[i]->theta)[j];
-        }
+        all_leaf_portfolio.col(i) = this->leaf_portfolio.col(bottom_nodes_vec[i]->portfolio_col);
+
+        // leaves keep their portfolio as theta for the json and binary output
+        bottom_nodes_vec[i]->theta = arma::conv_to<std::vector<double>>::from(all_leaf_portfolio.col(i));
     }
 
     arma::mat mu = arma::mean(all_leaf_portfolio, 0);
@@ -924,7 +1373,7 @@ double APTreeModel::calculate_R2(State &state, arma::mat &ft)
         {
             for (size_t j = 0; j < (*state.H).n_cols; j++)
             {
-                regressor(i, j + (*state.Z).n_cols) = (*state.H)(i, j);
+                regressor(i, j + (*state.Z).n_cols) = (*state.H)(state.obs(i), j);
             }
         }
     }
@@ -936,10 +1385,11 @@ double APTreeModel::calculate_R2(State &state, arma::mat &ft)
 
     for (size_t i = 0; i < state.num_obs_all; i++)
     {
+        size_t row = state.obs(i);
+        temp_month_index = (*state.month_index)[row];
         for (size_t j = 0; j < (*state.Z).n_cols; j++)
         {
-            temp_month_index = state.months_list->at((*state.months)(i));
-            regressor(i, j) = (*state.Z)(i, j) * ft(temp_month_index, 0);
+            regressor(i, j) = (*state.Z)(row, j) * ft(temp_month_index, 0);
         }
     }
 
@@ -952,6 +1402,11 @@ double APTreeModel::calculate_R2(State &state, arma::mat &ft)
         loss = fastLm((*state.Y), regressor);
     }
 
+    if (loss == std::numeric_limits<double>::max())
+    {
+        Rcpp::stop("regression of the R2 has no solution");
+    }
+
     loss = 1 - loss / arma::accu(pow(*state.Y, 2));
 
     return loss;
@@ -13,23 +13,23 @@ Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
 // TreeFactor_APTree_cpp
-Rcpp::List TreeFactor_APTree_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::mat Z, arma::mat H, arma::vec portfolio_weight, arma::vec loss_weight, arma::vec stocks, arma::vec months, arma::vec unique_months, arma::vec first_split_var, arma::vec second_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size, size_t max_depth, size_t num_iter, size_t num_cutpoints, double eta, bool equal_weight, bool no_H, bool abs_normalize, bool weighted_loss, bool stop_no_gain, double lambda_mean, double lambda_cov);
-RcppExport SEXP _TreeFactor_TreeFactor_APTree_cpp(SEXP RSEXP, SEXP YSEXP, SEXP XSEXP, SEXP ZSEXP, SEXP HSEXP, SEXP portfolio_weightSEXP, SEXP loss_weightSEXP, SEXP stocksSEXP, SEXP monthsSEXP, SEXP unique_monthsSEXP, SEXP first_split_varSEXP, SEXP second_split_varSEXP, SEXP num_stocksSEXP, SEXP num_monthsSEXP, SEXP min_leaf_sizeSEXP, SEXP max_depthSEXP, SEXP num_iterSEXP, SEXP num_cutpointsSEXP, SEXP etaSEXP, SEXP equal_weightSEXP, SEXP no_HSEXP, SEXP abs_normalizeSEXP, SEXP weighted_lossSEXP, SEXP stop_no_gainSEXP, SEXP lambda_meanSEXP, SEXP lambda_covSEXP) {
+Rcpp::List TreeFactor_APTree_cpp(const arma::vec& R, const arma::vec& Y, const arma::mat& X, const arma::mat& Z, const arma::mat& H, const arma::vec& portfolio_weight, const arma::vec& loss_weight, const arma::vec& stocks, const arma::vec& months, const arma::vec& unique_months, const arma::vec& first_split_var, const arma::vec& second_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size, size_t max_depth, size_t num_iter, size_t num_cutpoints, double eta, bool equal_weight, bool no_H, bool abs_normalize, bool weighted_loss, bool stop_no_gain, double lambda_mean, double lambda_cov, bool gram_loss, size_t num_threads, bool return_data, bool return_diagnostics, SEXP panel);
+RcppExport SEXP _TreeFactor_TreeFactor_APTree_cpp(SEXP RSEXP, SEXP YSEXP, SEXP XSEXP, SEXP ZSEXP, SEXP HSEXP, SEXP portfolio_weightSEXP, SEXP loss_weightSEXP, SEXP stocksSEXP, SEXP monthsSEXP, SEXP unique_monthsSEXP, SEXP first_split_varSEXP, SEXP second_split_varSEXP, SEXP num_stocksSEXP, SEXP num_monthsSEXP, SEXP min_leaf_sizeSEXP, SEXP max_depthSEXP, SEXP num_iterSEXP, SEXP num_cutpointsSEXP, SEXP etaSEXP, SEXP equal_weightSEXP, SEXP no_HSEXP, SEXP abs_normalizeSEXP, SEXP weighted_lossSEXP, SEXP stop_no_gainSEXP, SEXP lambda_meanSEXP, SEXP lambda_covSEXP, SEXP gram_lossSEXP, SEXP num_threadsSEXP, SEXP return_dataSEXP, SEXP return_diagnosticsSEXP, SEXP panelSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< arma::vec >::type R(RSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type Y(YSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type X(XSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type Z(ZSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type portfolio_weight(portfolio_weightSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type loss_weight(loss_weightSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type stocks(stocksSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type months(monthsSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type unique_months(unique_monthsSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type first_split_var(first_split_varSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type second_split_var(second_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type R(RSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type H(HSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type portfolio_weight(portfolio_weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type loss_weight(loss_weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type stocks(stocksSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type months(monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type unique_months(unique_monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type first_split_var(first_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type second_split_var(second_split_varSEXP);
     Rcpp::traits::input_parameter< size_t >::type num_stocks(num_stocksSEXP);
     Rcpp::traits::input_parameter< size_t >::type num_months(num_monthsSEXP);
     Rcpp::traits::input_parameter< size_t >::type min_leaf_size(min_leaf_sizeSEXP);
@@ -44,31 +44,36 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< bool >::type stop_no_gain(stop_no_gainSEXP);
     Rcpp::traits::input_parameter< double >::type lambda_mean(lambda_meanSEXP);
     Rcpp::traits::input_parameter< double >::type lambda_cov(lambda_covSEXP);
-    rcpp_result_gen = Rcpp::wrap(TreeFactor_APTree_cpp(R, Y, X, Z, H, portfolio_weight, loss_weight, stocks, months, unique_months, first_split_var, second_split_var, num_stocks, num_months, min_leaf_size, max_depth, num_iter, num_cutpoints, eta, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, lambda_mean, lambda_cov));
+    Rcpp::traits::input_parameter< bool >::type gram_loss(gram_lossSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_threads(num_threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type return_data(return_dataSEXP);
+    Rcpp::traits::input_parameter< bool >::type return_diagnostics(return_diagnosticsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type panel(panelSEXP);
+    rcpp_result_gen = Rcpp::wrap(TreeFactor_APTree_cpp(R, Y, X, Z, H, portfolio_weight, loss_weight, stocks, months, unique_months, first_split_var, second_split_var, num_stocks, num_months, min_leaf_size, max_depth, num_iter, num_cutpoints, eta, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, lambda_mean, lambda_cov, gram_loss, num_threads, return_data, return_diagnostics, panel));
     return rcpp_result_gen;
 END_RCPP
 }
 // TreeFactor_APTree_2_cpp
-Rcpp::List TreeFactor_APTree_2_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::mat Z, arma::mat H, arma::vec portfolio_weight, arma::vec loss_weight, arma::vec stocks, arma::vec months, arma::vec unique_months, arma::vec first_split_var, arma::mat first_split_mat, arma::vec second_split_var, arma::vec third_split_var, arma::vec deep_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size, size_t max_depth, size_t num_iter, size_t num_cutpoints, double lambda, bool equal_weight, bool no_H, bool abs_normalize, bool weighted_loss, bool stop_no_gain);
-RcppExport SEXP _TreeFactor_TreeFactor_APTree_2_cpp(SEXP RSEXP, SEXP YSEXP, SEXP XSEXP, SEXP ZSEXP, SEXP HSEXP, SEXP portfolio_weightSEXP, SEXP loss_weightSEXP, SEXP stocksSEXP, SEXP monthsSEXP, SEXP unique_monthsSEXP, SEXP first_split_varSEXP, SEXP first_split_matSEXP, SEXP second_split_varSEXP, SEXP third_split_varSEXP, SEXP deep_split_varSEXP, SEXP num_stocksSEXP, SEXP num_monthsSEXP, SEXP min_leaf_sizeSEXP, SEXP max_depthSEXP, SEXP num_iterSEXP, SEXP num_cutpointsSEXP, SEXP lambdaSEXP, SEXP equal_weightSEXP, SEXP no_HSEXP, SEXP abs_normalizeSEXP, SEXP weighted_lossSEXP, SEXP stop_no_gainSEXP) {
+Rcpp::List TreeFactor_APTree_2_cpp(const arma::vec& R, const arma::vec& Y, const arma::mat& X, const arma::mat& Z, const arma::mat& H, const arma::vec& portfolio_weight, const arma::vec& loss_weight, const arma::vec& stocks, const arma::vec& months, const arma::vec& unique_months, const arma::vec& first_split_var, const arma::mat& first_split_mat, const arma::vec& second_split_var, const arma::vec& third_split_var, const arma::vec& deep_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size, size_t max_depth, size_t num_iter, size_t num_cutpoints, double lambda, bool equal_weight, bool no_H, bool abs_normalize, bool weighted_loss, bool stop_no_gain, bool gram_loss, bool return_data, size_t num_threads, double eta);
+RcppExport SEXP _TreeFactor_TreeFactor_APTree_2_cpp(SEXP RSEXP, SEXP YSEXP, SEXP XSEXP, SEXP ZSEXP, SEXP HSEXP, SEXP portfolio_weightSEXP, SEXP loss_weightSEXP, SEXP stocksSEXP, SEXP monthsSEXP, SEXP unique_monthsSEXP, SEXP first_split_varSEXP, SEXP first_split_matSEXP, SEXP second_split_varSEXP, SEXP third_split_varSEXP, SEXP deep_split_varSEXP, SEXP num_stocksSEXP, SEXP num_monthsSEXP, SEXP min_leaf_sizeSEXP, SEXP max_depthSEXP, SEXP num_iterSEXP, SEXP num_cutpointsSEXP, SEXP lambdaSEXP, SEXP equal_weightSEXP, SEXP no_HSEXP, SEXP abs_normalizeSEXP, SEXP weighted_lossSEXP, SEXP stop_no_gainSEXP, SEXP gram_lossSEXP, SEXP return_dataSEXP, SEXP num_threadsSEXP, SEXP etaSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< arma::vec >::type R(RSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type Y(YSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type X(XSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type Z(ZSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type H(HSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type portfolio_weight(portfolio_weightSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type loss_weight(loss_weightSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type stocks(stocksSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type months(monthsSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type unique_months(unique_monthsSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type first_split_var(first_split_varSEXP);
-    Rcpp::traits::input_parameter< arma::mat >::type first_split_mat(first_split_matSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type second_split_var(second_split_varSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type third_split_var(third_split_varSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type deep_split_var(deep_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type R(RSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type H(HSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type portfolio_weight(portfolio_weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type loss_weight(loss_weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type stocks(stocksSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type months(monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type unique_months(unique_monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type first_split_var(first_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type first_split_mat(first_split_matSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type second_split_var(second_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type third_split_var(third_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type deep_split_var(deep_split_varSEXP);
     Rcpp::traits::input_parameter< size_t >::type num_stocks(num_stocksSEXP);
     Rcpp::traits::input_parameter< size_t >::type num_months(num_monthsSEXP);
     Rcpp::traits::input_parameter< size_t >::type min_leaf_size(min_leaf_sizeSEXP);
@@ -81,28 +86,153 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< bool >::type abs_normalize(abs_normalizeSEXP);
     Rcpp::traits::input_parameter< bool >::type weighted_loss(weighted_lossSEXP);
     Rcpp::traits::input_parameter< bool >::type stop_no_gain(stop_no_gainSEXP);
-    rcpp_result_gen = Rcpp::wrap(TreeFactor_APTree_2_cpp(R, Y, X, Z, H, portfolio_weight, loss_weight, stocks, months, unique_months, first_split_var, first_split_mat, second_split_var, third_split_var, deep_split_var, num_stocks, num_months, min_leaf_size, max_depth, num_iter, num_cutpoints, lambda, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain));
+    Rcpp::traits::input_parameter< bool >::type gram_loss(gram_lossSEXP);
+    Rcpp::traits::input_parameter< bool >::type return_data(return_dataSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_threads(num_threadsSEXP);
+    Rcpp::traits::input_parameter< double >::type eta(etaSEXP);
+    rcpp_result_gen = Rcpp::wrap(TreeFactor_APTree_2_cpp(R, Y, X, Z, H, portfolio_weight, loss_weight, stocks, months, unique_months, first_split_var, first_split_mat, second_split_var, third_split_var, deep_split_var, num_stocks, num_months, min_leaf_size, max_depth, num_iter, num_cutpoints, lambda, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, gram_loss, return_data, num_threads, eta));
+    return rcpp_result_gen;
+END_RCPP
+}
+// TreeFactor_APTree_boosting_cpp
+Rcpp::List TreeFactor_APTree_boosting_cpp(const arma::vec& R, const arma::vec& Y, const arma::mat& X, const arma::mat& Z, const arma::mat& H, const arma::vec& portfolio_weight, const arma::vec& loss_weight, const arma::vec& stocks, const arma::vec& months, const arma::vec& unique_months, const arma::vec& first_split_var, const arma::vec& second_split_var, const arma::vec& first_split_var_boosting, const arma::vec& second_split_var_boosting, size_t num_stocks, size_t num_months, size_t num_trees, size_t min_leaf_size, size_t max_depth, size_t max_depth_boosting, size_t num_iter, size_t num_cutpoints, double eta, bool equal_weight, bool no_H, bool no_H_boosting, bool abs_normalize, bool weighted_loss, bool stop_no_gain, double lambda_mean, double lambda_cov, bool gram_loss, size_t num_threads, bool return_data, SEXP panel);
+RcppExport SEXP _TreeFactor_TreeFactor_APTree_boosting_cpp(SEXP RSEXP, SEXP YSEXP, SEXP XSEXP, SEXP ZSEXP, SEXP HSEXP, SEXP portfolio_weightSEXP, SEXP loss_weightSEXP, SEXP stocksSEXP, SEXP monthsSEXP, SEXP unique_monthsSEXP, SEXP first_split_varSEXP, SEXP second_split_varSEXP, SEXP first_split_var_boostingSEXP, SEXP second_split_var_boostingSEXP, SEXP num_stocksSEXP, SEXP num_monthsSEXP, SEXP num_treesSEXP, SEXP min_leaf_sizeSEXP, SEXP max_depthSEXP, SEXP max_depth_boostingSEXP, SEXP num_iterSEXP, SEXP num_cutpointsSEXP, SEXP etaSEXP, SEXP equal_weightSEXP, SEXP no_HSEXP, SEXP no_H_boostingSEXP, SEXP abs_normalizeSEXP, SEXP weighted_lossSEXP, SEXP stop_no_gainSEXP, SEXP lambda_meanSEXP, SEXP lambda_covSEXP, SEXP gram_lossSEXP, SEXP num_threadsSEXP, SEXP return_dataSEXP, SEXP panelSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::vec& >::type R(RSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Z(ZSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type H(HSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type portfolio_weight(portfolio_weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type loss_weight(loss_weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type stocks(stocksSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type months(monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type unique_months(unique_monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type first_split_var(first_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type second_split_var(second_split_varSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type first_split_var_boosting(first_split_var_boostingSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type second_split_var_boosting(second_split_var_boostingSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_stocks(num_stocksSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_months(num_monthsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_trees(num_treesSEXP);
+    Rcpp::traits::input_parameter< size_t >::type min_leaf_size(min_leaf_sizeSEXP);
+    Rcpp::traits::input_parameter< size_t >::type max_depth(max_depthSEXP);
+    Rcpp::traits::input_parameter< size_t >::type max_depth_boosting(max_depth_boostingSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_iter(num_iterSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_cutpoints(num_cutpointsSEXP);
+    Rcpp::traits::input_parameter< double >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< bool >::type equal_weight(equal_weightSEXP);
+    Rcpp::traits::input_parameter< bool >::type no_H(no_HSEXP);
+    Rcpp::traits::input_parameter< bool >::type no_H_boosting(no_H_boostingSEXP);
+    Rcpp::traits::input_parameter< bool >::type abs_normalize(abs_normalizeSEXP);
+    Rcpp::traits::input_parameter< bool >::type weighted_loss(weighted_lossSEXP);
+    Rcpp::traits::input_parameter< bool >::type stop_no_gain(stop_no_gainSEXP);
+    Rcpp::traits::input_parameter< double >::type lambda_mean(lambda_meanSEXP);
+    Rcpp::traits::input_parameter< double >::type lambda_cov(lambda_covSEXP);
+    Rcpp::traits::input_parameter< bool >::type gram_loss(gram_lossSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_threads(num_threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type return_data(return_dataSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type panel(panelSEXP);
+    rcpp_result_gen = Rcpp::wrap(TreeFactor_APTree_boosting_cpp(R, Y, X, Z, H, portfolio_weight, loss_weight, stocks, months, unique_months, first_split_var, second_split_var, first_split_var_boosting, second_split_var_boosting, num_stocks, num_months, num_trees, min_leaf_size, max_depth, max_depth_boosting, num_iter, num_cutpoints, eta, equal_weight, no_H, no_H_boosting, abs_normalize, weighted_loss, stop_no_gain, lambda_mean, lambda_cov, gram_loss, num_threads, return_data, panel));
     return rcpp_result_gen;
 END_RCPP
 }
 // predict_APTree_cpp
-Rcpp::List predict_APTree_cpp(arma::mat X, Rcpp::StringVector json_string, arma::vec months);
-RcppExport SEXP _TreeFactor_predict_APTree_cpp(SEXP XSEXP, SEXP json_stringSEXP, SEXP monthsSEXP) {
+Rcpp::List predict_APTree_cpp(const arma::mat& X, SEXP handle, Rcpp::StringVector json_string, const arma::vec& months, const arma::vec& R, const arma::vec& weight, const arma::vec& leaf_id, const arma::mat& leaf_weight);
+RcppExport SEXP _TreeFactor_predict_APTree_cpp(SEXP XSEXP, SEXP handleSEXP, SEXP json_stringSEXP, SEXP monthsSEXP, SEXP RSEXP, SEXP weightSEXP, SEXP leaf_idSEXP, SEXP leaf_weightSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< arma::mat >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type handle(handleSEXP);
     Rcpp::traits::input_parameter< Rcpp::StringVector >::type json_string(json_stringSEXP);
-    Rcpp::traits::input_parameter< arma::vec >::type months(monthsSEXP);
-    rcpp_result_gen = Rcpp::wrap(predict_APTree_cpp(X, json_string, months));
+    Rcpp::traits::input_parameter< const arma::vec& >::type months(monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type R(RSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type weight(weightSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type leaf_id(leaf_idSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type leaf_weight(leaf_weightSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_APTree_cpp(X, handle, json_string, months, R, weight, leaf_id, leaf_weight));
+    return rcpp_result_gen;
+END_RCPP
+}
+// APTree_handle_cpp
+SEXP APTree_handle_cpp(Rcpp::StringVector json_string);
+RcppExport SEXP _TreeFactor_APTree_handle_cpp(SEXP json_stringSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::StringVector >::type json_string(json_stringSEXP);
+    rcpp_result_gen = Rcpp::wrap(APTree_handle_cpp(json_string));
+    return rcpp_result_gen;
+END_RCPP
+}
+// predict_APTree_batch_cpp
+Rcpp::IntegerVector predict_APTree_batch_cpp(SEXP handle, Rcpp::StringVector json_string, const arma::mat& X, size_t num_threads);
+RcppExport SEXP _TreeFactor_predict_APTree_batch_cpp(SEXP handleSEXP, SEXP json_stringSEXP, SEXP XSEXP, SEXP num_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< Rcpp::StringVector >::type json_string(json_stringSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_threads(num_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_APTree_batch_cpp(handle, json_string, X, num_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// APTree_save_binary_cpp
+void APTree_save_binary_cpp(Rcpp::StringVector json_string, arma::vec leaf_weight, std::string file, bool with_theta);
+RcppExport SEXP _TreeFactor_APTree_save_binary_cpp(SEXP json_stringSEXP, SEXP leaf_weightSEXP, SEXP fileSEXP, SEXP with_thetaSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::StringVector >::type json_string(json_stringSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type leaf_weight(leaf_weightSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< bool >::type with_theta(with_thetaSEXP);
+    APTree_save_binary_cpp(json_string, leaf_weight, file, with_theta);
+    return R_NilValue;
+END_RCPP
+}
+// APTree_load_binary_cpp
+Rcpp::List APTree_load_binary_cpp(std::string file);
+RcppExport SEXP _TreeFactor_APTree_load_binary_cpp(SEXP fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(APTree_load_binary_cpp(file));
+    return rcpp_result_gen;
+END_RCPP
+}
+// APTree_panel_cpp
+SEXP APTree_panel_cpp(const arma::mat& X, const arma::vec& months, const arma::vec& unique_months, size_t num_cutpoints, size_t num_threads, bool compact);
+RcppExport SEXP _TreeFactor_APTree_panel_cpp(SEXP XSEXP, SEXP monthsSEXP, SEXP unique_monthsSEXP, SEXP num_cutpointsSEXP, SEXP num_threadsSEXP, SEXP compactSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type months(monthsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type unique_months(unique_monthsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_cutpoints(num_cutpointsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type num_threads(num_threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type compact(compactSEXP);
+    rcpp_result_gen = Rcpp::wrap(APTree_panel_cpp(X, months, unique_months, num_cutpoints, num_threads, compact));
     return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_TreeFactor_TreeFactor_APTree_cpp", (DL_FUNC) &_TreeFactor_TreeFactor_APTree_cpp, 26},
-    {"_TreeFactor_TreeFactor_APTree_2_cpp", (DL_FUNC) &_TreeFactor_TreeFactor_APTree_2_cpp, 27},
-    {"_TreeFactor_predict_APTree_cpp", (DL_FUNC) &_TreeFactor_predict_APTree_cpp, 3},
+    {"_TreeFactor_TreeFactor_APTree_cpp", (DL_FUNC) &_TreeFactor_TreeFactor_APTree_cpp, 31},
+    {"_TreeFactor_TreeFactor_APTree_2_cpp", (DL_FUNC) &_TreeFactor_TreeFactor_APTree_2_cpp, 31},
+    {"_TreeFactor_TreeFactor_APTree_boosting_cpp", (DL_FUNC) &_TreeFactor_TreeFactor_APTree_boosting_cpp, 35},
+    {"_TreeFactor_predict_APTree_cpp", (DL_FUNC) &_TreeFactor_predict_APTree_cpp, 8},
+    {"_TreeFactor_APTree_handle_cpp", (DL_FUNC) &_TreeFactor_APTree_handle_cpp, 1},
+    {"_TreeFactor_predict_APTree_batch_cpp", (DL_FUNC) &_TreeFactor_predict_APTree_batch_cpp, 4},
+    {"_TreeFactor_APTree_save_binary_cpp", (DL_FUNC) &_TreeFactor_APTree_save_binary_cpp, 4},
+    {"_TreeFactor_APTree_load_binary_cpp", (DL_FUNC) &_TreeFactor_APTree_load_binary_cpp, 1},
+    {"_TreeFactor_APTree_panel_cpp", (DL_FUNC) &_TreeFactor_APTree_panel_cpp, 6},
     {NULL, NULL, 0}
 };
 
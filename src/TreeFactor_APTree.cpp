@@ -3,38 +3,58 @@
 #include "APTree.h"
 #include "model.h"
 #include "json_io.h"
+#include "panel.h"
 
 // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::export]]
-Rcpp::List TreeFactor_APTree_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::mat Z, arma::mat H, arma::vec portfolio_weight, arma::vec loss_weight, arma::vec stocks, arma::vec months, arma::vec unique_months, arma::vec first_split_var, arma::vec second_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size = 100, size_t max_depth = 5, size_t num_iter = 30, size_t num_cutpoints = 4, double eta = 1.0, bool equal_weight = false, bool no_H = false, bool abs_normalize = false, bool weighted_loss = false, bool stop_no_gain = false, double lambda_mean = 0, double lambda_cov = 0)
+Rcpp::List TreeFactor_APTree_cpp(const arma::vec &R, const arma::vec &Y, const arma::mat &X, const arma::mat &Z, const arma::mat &H, const arma::vec &portfolio_weight, const arma::vec &loss_weight, const arma::vec &stocks, const arma::vec &months, const arma::vec &unique_months, const arma::vec &first_split_var, const arma::vec &second_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size = 100, size_t max_depth = 5, size_t num_iter = 30, size_t num_cutpoints = 4, double eta = 1.0, bool equal_weight = false, bool no_H = false, bool abs_normalize = false, bool weighted_loss = false, bool stop_no_gain = false, double lambda_mean = 0, double lambda_cov = 0, bool gram_loss = false, size_t num_threads = 1, bool return_data = false, bool return_diagnostics = false, SEXP panel = R_NilValue)
 {
-    // we assume the number of months is continuous
-    std::map<size_t, size_t> months_list;
-    assert(num_months == unique_months.n_elem);
-    // a mapping from month to index from zero to num_months - 1
-    // it is not necessary to normalize months, adjust from zero in the input
-    for (size_t i = 0; i < num_months; i++)
+    // X, month index, sorted index and bin codes, prepared here unless the caller passes a prepared panel
+    // with a panel, the X and months arguments are not used
+    std::unique_ptr<APTree_panel> local_panel;
+    APTree_panel *prepared;
+    if (Rf_isNull(panel))
     {
-        // count from zero
-        months_list[unique_months(i)] = i;
+        assert(num_months == unique_months.n_elem);
+        local_panel.reset(new APTree_panel(X, months, unique_months, num_cutpoints, false, num_threads));
+        prepared = local_panel.get();
+    }
+    else
+    {
+        prepared = panel_from_sexp(panel);
     }
 
+    if (R.n_elem != prepared->num_obs || prepared->num_months != num_months)
+    {
+        Rcpp::stop("the panel does not match the returns, or the number of months");
+    }
+
+    // bin codes of the panel are reused if they are for the same cutpoints
+    arma::Mat<uint8_t> bin_code_fit;
+    const arma::Mat<uint8_t> *bin_code = prepared->fit_bin_code(num_cutpoints, bin_code_fit);
+
     // initialize state class to save data objects
-    State state(X, Y, R, Z, H, portfolio_weight, loss_weight, stocks, months, first_split_var, second_split_var, num_months, months_list, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, eta, lambda_mean, lambda_cov);
+    State state(*prepared->X, Y, R, Z, H, portfolio_weight, loss_weight, stocks, *prepared->months, first_split_var, second_split_var, num_months, prepared->months_list, prepared->month_index, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, gram_loss, eta, lambda_mean, lambda_cov, num_threads, bin_code);
 
     APTreeModel model(lambda_cov);
 
-    // calculate Xorder matrix, each index is row index of the data in the X matrix, but sorted from low to high
-    arma::umat Xorder(X.n_rows, X.n_cols, arma::fill::zeros);
-    for (size_t i = 0; i < X.n_cols; i++)
+    // Xorder matrix, each index is row index of the data in the X matrix, but sorted from low to high
+    // a panel prepared for this fit only hands its sorted index over, a shared one is copied
+    arma::Mat<uint32_t> Xorder;
+    if (local_panel)
     {
-        Xorder.col(i) = arma::sort_index(X.col(i));
+        Xorder.swap(local_panel->Xorder);
+    }
+    else
+    {
+        Xorder = prepared->Xorder;
     }
 
     // initialize tree class
-    APTree root(state.num_months, 1, state.num_obs_all, 1, 0, &Xorder);
+    // the tree partitions Xorder in place as it grows, rows of every leaf end up contiguous
+    APTree root(state.num_months, 1, state.num_obs_all, 1, 0, &Xorder, 0);
 
-    root.setN(X.n_rows);
+    root.setN(state.num_obs_all);
 
     // initialize the portfolio at the root node
     model.initialize_portfolio(state, &root);
@@ -59,15 +79,18 @@ Rcpp::List TreeFactor_APTree_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::ma
         // main function that grows the tree
         root.grow(break_flag, model, state, iter, criterion_values);
 
-        temp_vec.set_size(criterion_values.size());
-
-        for (size_t i = 0; i < criterion_values.size(); i++)
+        // output vector of all split criterion for debugging
+        if (return_diagnostics)
         {
-            temp_vec(i) = criterion_values[i];
-        }
+            temp_vec.set_size(criterion_values.size());
 
-        // output vector of all split criterion for debugging
-        all_criterion.push_back(temp_vec, to_string(iter));
+            for (size_t i = 0; i < criterion_values.size(); i++)
+            {
+                temp_vec(i) = criterion_values[i];
+            }
+
+            all_criterion.push_back(temp_vec, to_string(iter));
+        }
 
         if (break_flag)
         {
@@ -98,19 +121,42 @@ Rcpp::List TreeFactor_APTree_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::ma
     json j = tree_to_json(root);
     json_output[0] = j.dump(4);
 
+    // compiled tree for prediction, the json stays the portable copy
+    Rcpp::XPtr<APTree_flat> handle(new APTree_flat(root), true, Rf_install("APTree_flat"));
+
     // calculating the pricing error of the factor, run regression
     double loss = model.calculate_R2(state, ft);
 
-    return Rcpp::List::create(
-        Rcpp::Named("R") = R,
-        Rcpp::Named("X") = X,
-        Rcpp::Named("Xorder") = Xorder,
+    Rcpp::List output = Rcpp::List::create(
         Rcpp::Named("tree") = output_tree,
         Rcpp::Named("leaf_weight") = leaf_weight,
         Rcpp::Named("leaf_id") = leaf_node_index,
         Rcpp::Named("ft") = ft,
         Rcpp::Named("portfolio") = all_leaf_portfolio,
         Rcpp::Named("json") = json_output,
-        Rcpp::Named("R2") = loss,
-        Rcpp::Named("all_criterion") = all_criterion);
+        Rcpp::Named("handle") = handle,
+        Rcpp::Named("R2") = loss);
+
+    // copies of the training panel, only on request, they are as large as the data itself
+    if (return_data)
+    {
+        output.push_back(R, "R");
+        if (prepared->compact)
+        {
+            // a compact panel keeps no double X, return its single precision copy
+            output.push_back(arma::conv_to<arma::mat>::from(prepared->X_float), "X");
+        }
+        else
+        {
+            output.push_back(*prepared->X, "X");
+        }
+        output.push_back(Xorder, "Xorder");
+    }
+
+    if (return_diagnostics)
+    {
+        output.push_back(all_criterion, "all_criterion");
+    }
+
+    return output;
 }
\ No newline at end of file
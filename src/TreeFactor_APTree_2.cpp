@@ -3,136 +3,245 @@
 #include "APTree.h"
 #include "model.h"
 #include "json_io.h"
+#include "panel.h"
 
 // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::export]]
-Rcpp::List TreeFactor_APTree_2_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::mat Z, arma::mat H, arma::vec portfolio_weight, arma::vec loss_weight, arma::vec stocks, arma::vec months, arma::vec unique_months, arma::vec first_split_var, arma::mat first_split_mat, arma::vec second_split_var, arma::vec third_split_var, arma::vec deep_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size = 100, size_t max_depth = 5, size_t num_iter = 30, size_t num_cutpoints = 4, double lambda = 0.0001, bool equal_weight = false, bool no_H = false, bool abs_normalize = false, bool weighted_loss = false, bool stop_no_gain = false)
+Rcpp::List TreeFactor_APTree_2_cpp(const arma::vec &R, const arma::vec &Y, const arma::mat &X, const arma::mat &Z, const arma::mat &H, const arma::vec &portfolio_weight, const arma::vec &loss_weight, const arma::vec &stocks, const arma::vec &months, const arma::vec &unique_months, const arma::vec &first_split_var, const arma::mat &first_split_mat, const arma::vec &second_split_var, const arma::vec &third_split_var, const arma::vec &deep_split_var, size_t num_stocks, size_t num_months, size_t min_leaf_size = 100, size_t max_depth = 5, size_t num_iter = 30, size_t num_cutpoints = 4, double lambda = 0.0001, bool equal_weight = false, bool no_H = false, bool abs_normalize = false, bool weighted_loss = false, bool stop_no_gain = false, bool gram_loss = false, bool return_data = false, size_t num_threads = 1, double eta = 1.0)
 {
     // for the first cut, time is continuous
-    std::map<size_t, size_t> months_list_root;
     assert(num_months == unique_months.n_elem);
-    for (size_t i = 0; i < num_months; i++)
+
+    // the time series criterion accumulates the left side over the cutpoints of a column in order
+    // so every column of first_split_mat must hold num_cutpoints strictly increasing cutpoints
+    if (first_split_mat.n_rows < num_cutpoints || first_split_mat.n_cols != first_split_var.n_elem)
+    {
+        Rcpp::stop("first_split_mat must have num_cutpoints rows and one column for every first_split_var");
+    }
+    for (size_t j = 0; j < first_split_mat.n_cols; j++)
     {
-        // count from zero
-        months_list_root[unique_months(i)] = i;
+        for (size_t i = 1; i < num_cutpoints; i++)
+        {
+            if (!(first_split_mat(i, j) > first_split_mat(i - 1, j)))
+            {
+                Rcpp::stop("the cutpoints in every column of first_split_mat must be strictly increasing");
+            }
+        }
     }
 
+    // month index, sorted index and bin codes of X, shared by the macro split and the regime subtrees
+    APTree_panel panel(X, months, unique_months, num_cutpoints, false, num_threads);
+
     size_t num_obs_all = X.n_rows;
 
     // initialize state class to save data objects
-    State state(X, Y, R, Z, H, portfolio_weight, loss_weight, stocks, months, first_split_var, second_split_var, third_split_var, deep_split_var, num_months, months_list_root, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, lambda, num_obs_all, first_split_mat);
+    State state(X, Y, R, Z, H, portfolio_weight, loss_weight, stocks, months, first_split_var, second_split_var, third_split_var, deep_split_var, num_months, panel.months_list, panel.month_index, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, gram_loss, lambda, num_obs_all, first_split_mat);
 
     APTreeModel model(lambda);
 
-    // calculate Xorder matrix, each index is row index of the data in the X matrix, but sorted from low to high
-    arma::umat Xorder(X.n_rows, X.n_cols, arma::fill::zeros);
-    for (size_t i = 0; i < X.n_cols; i++)
-    {
-        Xorder.col(i) = arma::sort_index(X.col(i));
-    }
+    // the tree partitions Xorder in place as it grows, rows of every leaf end up contiguous
+    arma::Mat<uint32_t> Xorder;
+    Xorder.swap(panel.Xorder);
 
     // initialize tree class
-    APTree root(state.num_months, 1, state.num_obs_all, 1, 0, &Xorder);
+    APTree root(state.num_months, 1, state.num_obs_all, 1, 0, &Xorder, 0);
 
     root.setN(X.n_rows);
 
     model.initialize_portfolio(state, &root);
 
-    model.initialize_regressor_matrix(state);
+    // the macro split is priced from month level blocks only, the N-row regressor is not needed
+    model.initialize_gram_matrix(state);
 
     bool break_flag = false;
 
     // grow the first cut with macro variable
     root.grow_APTree_TS(break_flag, model, state);
 
-    // search the tree, find months on the left / right child
-    arma::vec leaf_index(X.n_rows);
-    model.predict_AP(X, root, months, leaf_index);
-    
-    // cout << "leaf index " << leaf_index << endl;
-
-    // size_t count_left = 0;
-    // size_t count_right = 0;
-    // for (size_t i = 0; i < X.n_rows; i++)
-    // {
-    //     if (leaf_index(i) == 2)
-    //     {
-    //         count_left++;
-    //     }
-    //     else
-    //     {
-    //         count_right++;
-    //     }
-    // }
-
-    // arma::vec months_left(count_left);
-    // arma::vec months_right(count_right);
-    // arma::vec index_left(count_left);
-    // arma::vec index_right(count_right);
-    // size_t temp_ind_left = 0;
-    // size_t temp_ind_right = 0;
-    // for (size_t i = 0; i < X.n_rows; i++)
-    // {
-    //     if (leaf_index(i) == 2)
-    //     {
-    //         months_left(temp_ind_left) = months(i);
-    //         index_left(temp_ind_left) = i;
-    //         temp_ind_left++;
-    //     }
-    //     else
-    //     {
-    //         months_right(temp_ind_right) = months(i);
-    //         index_right(temp_ind_right) = i;
-    //         temp_ind_right++;
-    //     }
-    // }
-
-    // arma::vec unique_months_right = arma::sort(arma::unique(months_right));
-    // arma::vec unique_months_left = arma::sort(arma::unique(months_left));
-
-    // std::map<size_t, size_t> months_list_left;
-    // std::map<size_t, size_t> months_list_right;
-
-    // for (size_t i = 0; i < unique_months_left.n_elem; i++)
-    // {
-    //     // count from zero
-    //     months_list_left[unique_months_left(i)] = i;
-    // }
-
-    // for (size_t i = 0; i < unique_months_right.n_elem; i++)
-    // {
-    //     // count from zero
-    //     months_list_right[unique_months_right(i)] = i;
-    // }
-
-    // size_t num_months_left = unique_months_left.n_elem;
-    // size_t num_months_right = unique_months_right.n_elem;
-
-    // root.getl()->theta.resize(num_months_left);
-    // root.getr()->theta.resize(num_months_right);
-
-    // cout << "number of data on left and right " << count_left << " " << count_right << endl;
-
-    // cout << "number of months on left and right " << num_months_left << " " << num_months_right << endl;
-
-    // State state_left(X, Y, R, Z, H, portfolio_weight, loss_weight, stocks, months, first_split_var, second_split_var, third_split_var, deep_split_var, index_left, num_months_left, months_list_left, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, lambda, count_left, first_split_mat);
-
-    // State state_right(X, Y, R, Z, H, portfolio_weight, loss_weight, stocks, months, first_split_var, second_split_var, third_split_var, deep_split_var, index_right, num_months_right, months_list_right, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, lambda, count_right, first_split_mat);
-
-    // state.flag_first_cut = false;
-
-    // state.split_candidates = split_candidates_backup;
+    arma::vec leaf_node_index;
+    arma::mat all_leaf_portfolio, leaf_weight, ft;
 
+    // months of the left and right regime
+    Rcpp::List regime_months = Rcpp::List::create();
+
+    if (root.getl() == 0)
+    {
+        // no macro split, the factor of the root alone
+        model.calculate_factor(root, leaf_node_index, all_leaf_portfolio, leaf_weight, ft, state);
+    }
+    else
+    {
+        // a macro variable is the same for all stocks in a month, so every month is on one side of the split
+        // each side is a regime, grown as its own cross sectional tree over the months of the regime
+        // the rows of a regime are the Xorder rows of its root, X, R, Z and H are shared, not copied
+        APTree *regime_root[2] = {root.getl(), root.getr()};
+        std::vector<uint32_t> obs_index[2];
+        std::map<size_t, size_t> months_list_regime[2];
+        std::vector<uint32_t> month_index_regime[2];
+        std::vector<size_t> month_global[2]; // index in unique_months of every month of the regime
+        arma::vec Y_regime[2];
+        arma::vec loss_weight_regime[2];
+        std::unique_ptr<State> state_regime[2];
+        std::unique_ptr<APTreeModel> model_regime[2];
+
+        // regimes grow concurrently, the threads of each split search are the rest
+        size_t regime_threads = (num_threads >= 2) ? 2 : 1;
+        size_t split_threads = std::max<size_t>(1, num_threads / regime_threads);
+
+        for (size_t k = 0; k < 2; k++)
+        {
+            size_t num_obs_regime = regime_root[k]->getN();
+            if (num_obs_regime == 0)
+            {
+                // the time series criterion rejects such cuts, a regime without months cannot be grown
+                Rcpp::stop("the macro split left a regime without observations");
+            }
+
+            obs_index[k].resize(num_obs_regime);
+            for (size_t i = 0; i < num_obs_regime; i++)
+            {
+                obs_index[k][i] = regime_root[k]->Xorder_index(i, 0);
+            }
+            std::sort(obs_index[k].begin(), obs_index[k].end());
+
+            // dense month index over the months of the regime, other rows are never read
+            for (size_t i = 0; i < num_obs_regime; i++)
+            {
+                months_list_regime[k][months(obs_index[k][i])] = 0;
+            }
+
+            arma::vec months_value(months_list_regime[k].size());
+            size_t t = 0;
+            for (auto &month : months_list_regime[k])
+            {
+                month.second = t;
+                months_value(t) = month.first;
+                month_global[k].push_back(panel.months_list.at(month.first));
+                t++;
+            }
+            regime_months.push_back(months_value);
+
+            month_index_regime[k].assign(X.n_rows, 0);
+            Y_regime[k].set_size(num_obs_regime);
+            loss_weight_regime[k].set_size(num_obs_regime);
+            for (size_t i = 0; i < num_obs_regime; i++)
+            {
+                size_t row = obs_index[k][i];
+                month_index_regime[k][row] = months_list_regime[k].at(months(row));
+                Y_regime[k](i) = Y(row);
+                loss_weight_regime[k](i) = loss_weight(row);
+            }
+
+            state_regime[k].reset(new State(state, obs_index[k], Y_regime[k], loss_weight_regime[k], months_list_regime[k].size(), months_list_regime[k], month_index_regime[k], &panel.bin_code, split_threads, eta));
+            model_regime[k].reset(new APTreeModel(lambda));
+
+            cout << "regime " << k + 1 << ": " << num_obs_regime << " observations in " << months_list_regime[k].size() << " months" << endl;
+        }
+
+        // nested, so the split search of each regime can use its threads
+        int max_active_levels = omp_get_max_active_levels();
+        omp_set_max_active_levels(2);
+
+        // the regimes do not print from their threads, messages are kept per regime and printed in order below
+        // an exception must not leave the parallel region, the first one is rethrown after the nesting level is restored
+        std::ostringstream regime_messages[2];
+        std::exception_ptr error;
+
+#pragma omp parallel for schedule(static) num_threads(regime_threads)
+        for (size_t k = 0; k < 2; k++)
+        {
+            try
+            {
+                APTree *node = regime_root[k];
+                State &regime = *state_regime[k];
+
+                // the portfolio of the regime root over the months of its regime only, first column of the regime model
+                node->portfolio_col = 0;
+                model_regime[k]->initialize_portfolio(regime, node);
+                model_regime[k]->initialize_regressor_matrix(regime);
+
+                bool regime_break_flag = false;
+                std::vector<double> criterion_values;
+
+                for (size_t iter = 0; iter < num_iter; iter++)
+                {
+                    node->grow(regime_break_flag, *model_regime[k], regime, iter, criterion_values, regime_messages[k]);
+
+                    if (regime_break_flag)
+                    {
+                        break;
+                    }
+                }
+            }
+            catch (...)
+            {
+#pragma omp critical(regime_error)
+                {
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+            }
+        }
+
+        omp_set_max_active_levels(max_active_levels);
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+
+        for (size_t k = 0; k < 2; k++)
+        {
+            if (!regime_messages[k].str().empty())
+            {
+                cout << "regime " << k + 1 << ": " << regime_messages[k].str();
+            }
+        }
+
+        // leaves of both regimes in the order of root.getbots, left regime first
+        // a leaf portfolio is zero in the months of the other regime, as in predict, so ft = portfolio * leaf_weight
+        arma::vec leaf_id_regime[2];
+        arma::mat portfolio_regime[2], leaf_weight_regime[2], ft_regime[2];
+        for (size_t k = 0; k < 2; k++)
+        {
+            model_regime[k]->calculate_factor(*regime_root[k], leaf_id_regime[k], portfolio_regime[k], leaf_weight_regime[k], ft_regime[k], *state_regime[k]);
+        }
+
+        size_t num_leaves_left = leaf_id_regime[0].n_elem;
+        leaf_node_index = arma::join_cols(leaf_id_regime[0], leaf_id_regime[1]);
+        leaf_weight = arma::join_cols(leaf_weight_regime[0], leaf_weight_regime[1]);
+        all_leaf_portfolio.zeros(num_months, leaf_node_index.n_elem);
+        ft.zeros(num_months, 1);
+
+        for (size_t k = 0; k < 2; k++)
+        {
+            size_t offset = (k == 0) ? 0 : num_leaves_left;
+            for (size_t m = 0; m < month_global[k].size(); m++)
+            {
+                size_t t = month_global[k][m];
+                for (size_t j = 0; j < portfolio_regime[k].n_cols; j++)
+                {
+                    all_leaf_portfolio(t, offset + j) = portfolio_regime[k](m, j);
+                }
+                ft(t, 0) = ft_regime[k](m, 0);
+            }
+        }
+
+        // calculate_factor of a regime sets theta over the months of the regime only, the two lengths differ
+        // the json and binary output expect one length, so every leaf keeps its portfolio over all months
+        std::vector<APTree *> leaves;
+        root.getbots(leaves);
+        for (size_t j = 0; j < leaves.size(); j++)
+        {
+            leaves[j]->theta = arma::conv_to<std::vector<double>>::from(all_leaf_portfolio.col(j));
+        }
+    }
 
     double cutpoint = root.getv();
     double cutvalue = root.getc();
 
-
-    arma::vec leaf_node_index;
-    arma::mat all_leaf_portfolio, leaf_weight, ft;
-
-    model.calculate_factor(root, leaf_node_index, all_leaf_portfolio, leaf_weight, ft, state);
-
     cout << "fitted tree " << endl;
     cout.precision(3);
     cout << root << endl;
@@ -151,21 +260,32 @@ Rcpp::List TreeFactor_APTree_2_cpp(arma::vec R, arma::vec Y, arma::mat X, arma::
     json j = tree_to_json(root);
     json_output[0] = j.dump(4);
 
+    // compiled tree for prediction, the json stays the portable copy
+    Rcpp::XPtr<APTree_flat> handle(new APTree_flat(root), true, Rf_install("APTree_flat"));
+
     // calculating the pricing error of the factor, run regression
-    // double loss = model.calculate_R2(state, ft);
-    double loss = 0;
+    double loss = model.calculate_R2(state, ft);
 
-    return Rcpp::List::create(
-        Rcpp::Named("R") = R,
-        Rcpp::Named("X") = X,
-        Rcpp::Named("Xorder") = Xorder,
+    Rcpp::List output = Rcpp::List::create(
         Rcpp::Named("tree") = output_tree,
         Rcpp::Named("leaf_weight") = leaf_weight,
         Rcpp::Named("leaf_id") = leaf_node_index,
         Rcpp::Named("ft") = ft,
         Rcpp::Named("portfolio") = all_leaf_portfolio,
         Rcpp::Named("json") = json_output,
+        Rcpp::Named("handle") = handle,
         Rcpp::Named("R2") = loss,
         Rcpp::Named("cutpoint") = cutpoint,
-        Rcpp::Named("cutvalue") = cutvalue);
+        Rcpp::Named("cutvalue") = cutvalue,
+        Rcpp::Named("regime_months") = regime_months);
+
+    // copies of the training panel, only on request, they are as large as the data itself
+    if (return_data)
+    {
+        output.push_back(R, "R");
+        output.push_back(X, "X");
+        output.push_back(Xorder, "Xorder");
+    }
+
+    return output;
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include "common.h"
+#include "state.h"
+#include "APTree.h"
+#include "model.h"
+#include "json_io.h"
+#include "panel.h"
+
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::export]]
+Rcpp::List TreeFactor_APTree_boosting_cpp(const arma::vec &R, const arma::vec &Y, const arma::mat &X, const arma::mat &Z, const arma::mat &H, const arma::vec &portfolio_weight, const arma::vec &loss_weight, const arma::vec &stocks, const arma::vec &months, const arma::vec &unique_months, const arma::vec &first_split_var, const arma::vec &second_split_var, const arma::vec &first_split_var_boosting, const arma::vec &second_split_var_boosting, size_t num_stocks, size_t num_months, size_t num_trees = 2, size_t min_leaf_size = 100, size_t max_depth = 5, size_t max_depth_boosting = 0, size_t num_iter = 30, size_t num_cutpoints = 4, double eta = 1.0, bool equal_weight = false, bool no_H = false, bool no_H_boosting = false, bool abs_normalize = false, bool weighted_loss = false, bool stop_no_gain = false, double lambda_mean = 0, double lambda_cov = 0, bool gram_loss = false, size_t num_threads = 1, bool return_data = false, SEXP panel = R_NilValue)
+{
+    // boosted P-Trees, tree k is fitted to the residual of Y after regressing it on the factor of tree k - 1
+    // data, month index, sorted index and bin codes are prepared once and shared by all trees
+    // they are prepared here unless the caller passes a prepared panel
+    // with a panel, the X and months arguments are not used
+    // trees after the first one use max_depth_boosting, no_H_boosting and the *_boosting split variables
+    std::unique_ptr<APTree_panel> local_panel;
+    APTree_panel *prepared;
+    if (Rf_isNull(panel))
+    {
+        assert(num_months == unique_months.n_elem);
+        local_panel.reset(new APTree_panel(X, months, unique_months, num_cutpoints, false, num_threads));
+        prepared = local_panel.get();
+    }
+    else
+    {
+        prepared = panel_from_sexp(panel);
+    }
+
+    if (R.n_elem != prepared->num_obs || prepared->num_months != num_months)
+    {
+        Rcpp::stop("the panel does not match the returns, or the number of months");
+    }
+
+    arma::Mat<uint8_t> bin_code_fit;
+    const arma::Mat<uint8_t> *bin_code = prepared->fit_bin_code(num_cutpoints, bin_code_fit);
+    const std::vector<uint32_t> &month_index = prepared->month_index;
+
+    // residualized Y, updated in place after every tree, the state points at it
+    arma::vec Y_residual = Y;
+
+    State state(*prepared->X, Y_residual, R, Z, H, portfolio_weight, loss_weight, stocks, *prepared->months, first_split_var, second_split_var, num_months, prepared->months_list, prepared->month_index, num_stocks, min_leaf_size, max_depth, num_cutpoints, equal_weight, no_H, abs_normalize, weighted_loss, stop_no_gain, gram_loss, eta, lambda_mean, lambda_cov, num_threads, bin_code);
+
+    // sorted once in the panel, every tree partitions its own copy in place
+    arma::Mat<uint32_t> Xorder;
+
+    if (max_depth_boosting == 0)
+    {
+        max_depth_boosting = max_depth;
+    }
+
+    size_t num_Z = Z.n_cols;
+
+    // regressor of the residual step, H columns are filled when no_H changes between trees
+    arma::mat regressor;
+    lm_workspace lm_work;
+
+    arma::mat all_ft(num_months, num_trees, arma::fill::zeros);
+    arma::vec all_R2(num_trees, arma::fill::zeros);
+    Rcpp::List trees = Rcpp::List::create();
+
+    std::vector<double> criterion_values;
+
+    for (size_t k = 0; k < num_trees; k++)
+    {
+        state.max_depth = (k == 0) ? max_depth : max_depth_boosting;
+        state.no_H = (k == 0) ? no_H : no_H_boosting;
+        state.first_split_var = (k == 0) ? &first_split_var : &first_split_var_boosting;
+        state.second_split_var = (k == 0) ? &second_split_var : &second_split_var_boosting;
+        state.overall_loss = std::numeric_limits<double>::max();
+
+        Xorder = prepared->Xorder;
+
+        APTreeModel model(lambda_cov);
+
+        APTree root(state.num_months, 1, state.num_obs_all, 1, 0, &Xorder, 0);
+
+        root.setN(state.num_obs_all);
+
+        model.initialize_portfolio(state, &root);
+
+        model.initialize_regressor_matrix(state);
+
+        bool break_flag = false;
+
+        for (size_t iter = 0; iter < num_iter; iter++)
+        {
+            root.grow(break_flag, model, state, iter, criterion_values);
+
+            if (break_flag)
+            {
+                break;
+            }
+        }
+
+        arma::vec leaf_node_index;
+        arma::mat all_leaf_portfolio, leaf_weight, ft;
+
+        model.calculate_factor(root, leaf_node_index, all_leaf_portfolio, leaf_weight, ft, state);
+
+        cout << "fitted tree " << k + 1 << endl;
+        cout.precision(3);
+        cout << root << endl;
+
+        std::stringstream tree_stream;
+        Rcpp::StringVector output_tree(1);
+        tree_stream.precision(10);
+        tree_stream << root;
+        output_tree(0) = tree_stream.str();
+
+        Rcpp::StringVector json_output(1);
+        json j = tree_to_json(root);
+        json_output[0] = j.dump(4);
+
+        Rcpp::XPtr<APTree_flat> handle(new APTree_flat(root), true, Rf_install("APTree_flat"));
+
+        // R2 of the current residual on the factor of this tree
+        all_R2(k) = model.calculate_R2(state, ft);
+        all_ft.col(k) = ft.col(0);
+
+        // residual step, Y ~ Z * ft (+ H), the same regression as the pricing loss
+        size_t num_regressors = state.no_H ? num_Z : num_Z + H.n_cols;
+        if (regressor.n_cols != num_regressors)
+        {
+            regressor.zeros(state.num_obs_all, num_regressors);
+            if (!state.no_H)
+            {
+                regressor.cols(num_Z, num_regressors - 1) = H;
+            }
+        }
+
+        for (size_t i = 0; i < state.num_obs_all; i++)
+        {
+            for (size_t j = 0; j < num_Z; j++)
+            {
+                regressor(i, j) = Z(i, j) * ft(month_index[i], 0);
+            }
+        }
+
+        if (fastLm(Y_residual, regressor, lm_work) == std::numeric_limits<double>::max())
+        {
+            Rcpp::stop("residual regression of the boosting step has no solution");
+        }
+
+        // same size, so the memory the state points at is kept
+        Y_residual = lm_work.resid;
+
+        trees.push_back(Rcpp::List::create(
+            Rcpp::Named("tree") = output_tree,
+            Rcpp::Named("leaf_weight") = leaf_weight,
+            Rcpp::Named("leaf_id") = leaf_node_index,
+            Rcpp::Named("ft") = ft,
+            Rcpp::Named("portfolio") = all_leaf_portfolio,
+            Rcpp::Named("json") = json_output,
+            Rcpp::Named("handle") = handle,
+            Rcpp::Named("R2") = all_R2(k),
+            Rcpp::Named("beta") = lm_work.coef));
+    }
+
+    Rcpp::List output = Rcpp::List::create(
+        Rcpp::Named("trees") = trees,
+        Rcpp::Named("ft") = all_ft,
+        Rcpp::Named("R2") = all_R2);
+
+    if (return_data)
+    {
+        output.push_back(Y_residual, "residual");
+    }
+
+    return output;
+}
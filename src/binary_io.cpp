@@ -0,0 +1,490 @@
+#include "binary_io.h"
+#include "json_io.h"
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// encoding is byte by byte, so the file is little endian on any host
+
+static void put_u32(std::vector<unsigned char> &buf, uint32_t x)
+{
+    for (size_t b = 0; b < 4; b++)
+    {
+        buf.push_back((unsigned char)((x >> (8 * b)) & 0xFF));
+    }
+}
+
+static void put_u64(std::vector<unsigned char> &buf, uint64_t x)
+{
+    for (size_t b = 0; b < 8; b++)
+    {
+        buf.push_back((unsigned char)((x >> (8 * b)) & 0xFF));
+    }
+}
+
+static void put_f64(std::vector<unsigned char> &buf, double x)
+{
+    uint64_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    put_u64(buf, u);
+}
+
+static void pad8(std::vector<unsigned char> &buf)
+{
+    while (buf.size() % 8 != 0)
+    {
+        buf.push_back(0);
+    }
+}
+
+class binary_reader
+{
+public:
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+
+    binary_reader(const unsigned char *data, size_t size) : data(data), size(size), pos(0) {}
+
+    void need(size_t n)
+    {
+        if (pos + n > size)
+        {
+            Rcpp::stop("truncated APTree binary file");
+        }
+    }
+
+    void need_array(size_t count, size_t width)
+    {
+        // count elements of width bytes, checked by division so a corrupted count cannot overflow
+        if (pos > size || count > (size - pos) / width)
+        {
+            Rcpp::stop("truncated APTree binary file");
+        }
+    }
+
+    uint32_t get_u32()
+    {
+        need(4);
+        uint32_t x = 0;
+        for (size_t b = 0; b < 4; b++)
+        {
+            x |= (uint32_t)data[pos + b] << (8 * b);
+        }
+        pos += 4;
+        return x;
+    }
+
+    uint64_t get_u64()
+    {
+        need(8);
+        uint64_t x = 0;
+        for (size_t b = 0; b < 8; b++)
+        {
+            x |= (uint64_t)data[pos + b] << (8 * b);
+        }
+        pos += 8;
+        return x;
+    }
+
+    double get_f64()
+    {
+        uint64_t u = get_u64();
+        double x;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+    }
+
+    void skip_pad8()
+    {
+        pos = (pos + 7) / 8 * 8;
+    }
+};
+
+static void leaf_order(const APTree_flat &flat, size_t k, std::vector<size_t> &order)
+{
+    // leaves left to right, the order of APTree::getbots
+    if (flat.left[k] == 0)
+    {
+        order.push_back(k);
+    }
+    else
+    {
+        leaf_order(flat, flat.left[k], order);
+        leaf_order(flat, flat.left[k] + 1, order);
+    }
+}
+
+void tree_to_binary(APTree &root, const arma::vec &leaf_weight, bool with_theta, const std::string &file)
+{
+    // same breadth first order as APTree_flat::from_tree
+    std::vector<APTree *> nodes(1, &root);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i]->getl())
+        {
+            nodes.push_back(nodes[i]->getl());
+            nodes.push_back(nodes[i]->getr());
+        }
+    }
+
+    APTree_flat flat(root);
+    std::vector<APTree *> leaves;
+    root.getbots(leaves);
+
+    if (leaf_weight.n_elem != leaves.size())
+    {
+        Rcpp::stop("leaf_weight must have one element for every leaf of the tree");
+    }
+
+    size_t num_nodes = nodes.size();
+    size_t dim_theta = with_theta ? leaves[0]->theta.size() : 0;
+
+    std::vector<unsigned char> buf;
+    buf.reserve(64 + num_nodes * 40 + leaves.size() * 8 * (1 + dim_theta));
+
+    buf.push_back('A');
+    buf.push_back('P');
+    buf.push_back('T');
+    buf.push_back('B');
+    put_u32(buf, APTREE_BINARY_VERSION);
+    put_u32(buf, num_nodes);
+    put_u32(buf, leaves.size());
+    put_u32(buf, dim_theta);
+    put_u32(buf, with_theta ? 1 : 0);
+    pad8(buf);
+
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        put_u32(buf, flat.var[i]);
+    }
+    pad8(buf);
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        put_u32(buf, flat.left[i]);
+    }
+    pad8(buf);
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        put_u32(buf, nodes[i]->getc_index());
+    }
+    pad8(buf);
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        put_u32(buf, nodes[i]->getdepth());
+    }
+    pad8(buf);
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        put_f64(buf, flat.cutpoint[i]);
+    }
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        put_u64(buf, flat.leaf_id[i]);
+    }
+
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+        put_f64(buf, leaf_weight(i));
+    }
+
+    if (with_theta)
+    {
+        for (size_t i = 0; i < leaves.size(); i++)
+        {
+            if (leaves[i]->theta.size() != dim_theta)
+            {
+                Rcpp::stop("all leaves must have theta of the same length");
+            }
+            for (size_t j = 0; j < dim_theta; j++)
+            {
+                put_f64(buf, leaves[i]->theta[j]);
+            }
+        }
+    }
+
+    std::ofstream out(file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        Rcpp::stop("cannot open " + file + " for writing");
+    }
+    out.write((const char *)buf.data(), buf.size());
+    if (!out)
+    {
+        Rcpp::stop("cannot write " + file);
+    }
+
+    return;
+}
+
+static void decode_model(binary_reader &in, APTree_binary &model)
+{
+    in.need(4);
+    if (std::memcmp(in.data, "APTB", 4) != 0)
+    {
+        Rcpp::stop("not an APTree binary file");
+    }
+    in.pos = 4;
+
+    uint32_t version = in.get_u32();
+    if (version == 0 || version > APTREE_BINARY_VERSION)
+    {
+        Rcpp::stop("unsupported APTree binary version " + std::to_string(version));
+    }
+
+    size_t num_nodes = in.get_u32();
+    size_t num_leaves = in.get_u32();
+    size_t dim_theta = in.get_u32();
+    uint32_t flags = in.get_u32();
+    in.skip_pad8();
+
+    // a full binary tree, every interior node has two children
+    if (num_nodes == 0 || num_nodes % 2 == 0 || num_leaves != (num_nodes + 1) / 2)
+    {
+        Rcpp::stop("corrupted APTree binary file");
+    }
+
+    // four u32 and two 8 byte arrays of num_nodes elements, before anything is allocated
+    in.need_array(num_nodes, 32);
+
+    APTree_flat &flat = model.flat;
+    flat.var.resize(num_nodes);
+    flat.left.resize(num_nodes);
+    flat.cutpoint.resize(num_nodes);
+    flat.leaf_id.resize(num_nodes);
+    model.cutpoint_index.resize(num_nodes);
+    model.depth.resize(num_nodes);
+
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        flat.var[i] = in.get_u32();
+    }
+    in.skip_pad8();
+    size_t num_interior = 0;
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        flat.left[i] = in.get_u32();
+        if (flat.left[i] != 0)
+        {
+            // breadth first order, the children of the j-th interior node are 2j + 1 and 2j + 2
+            // so every node but the root has exactly one parent, which comes before it
+            if (flat.left[i] != 2 * num_interior + 1 || flat.left[i] <= i)
+            {
+                Rcpp::stop("corrupted APTree binary file");
+            }
+            num_interior++;
+        }
+    }
+    if (num_interior + num_leaves != num_nodes)
+    {
+        Rcpp::stop("corrupted APTree binary file");
+    }
+    in.skip_pad8();
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        model.cutpoint_index[i] = in.get_u32();
+    }
+    in.skip_pad8();
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        model.depth[i] = in.get_u32();
+    }
+    in.skip_pad8();
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        flat.cutpoint[i] = in.get_f64();
+    }
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        flat.leaf_id[i] = in.get_u64();
+    }
+
+    in.need_array(num_leaves, 8);
+    model.leaf_weight.resize(num_leaves);
+    for (size_t i = 0; i < num_leaves; i++)
+    {
+        model.leaf_weight[i] = in.get_f64();
+    }
+
+    model.dim_theta = dim_theta;
+    model.theta.clear();
+    if (flags & 1)
+    {
+        if (dim_theta != 0)
+        {
+            in.need_array(num_leaves, 8 * dim_theta);
+        }
+        model.theta.resize(num_leaves * dim_theta);
+        for (size_t i = 0; i < model.theta.size(); i++)
+        {
+            model.theta[i] = in.get_f64();
+        }
+    }
+
+    return;
+}
+
+void binary_to_model(const std::string &file, APTree_binary &model)
+{
+#ifndef _WIN32
+    // map the file and decode straight from the mapped pages
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        Rcpp::stop("cannot open " + file);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        Rcpp::stop("cannot read " + file);
+    }
+
+    size_t size = info.st_size;
+    void *mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        Rcpp::stop("cannot map " + file);
+    }
+
+    binary_reader in((const unsigned char *)mapped, size);
+    try
+    {
+        decode_model(in, model);
+    }
+    catch (...)
+    {
+        munmap(mapped, size);
+        throw;
+    }
+    munmap(mapped, size);
+#else
+    // no mmap, read the whole file into memory
+    std::ifstream input(file.c_str(), std::ios::in | std::ios::binary);
+    if (!input)
+    {
+        Rcpp::stop("cannot open " + file);
+    }
+    std::vector<unsigned char> buf((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    binary_reader in(buf.data(), buf.size());
+    decode_model(in, model);
+#endif
+
+    return;
+}
+
+void model_to_tree(APTree_binary &model, APTree &root)
+{
+    // rebuild the linked tree, for to_json and anything else that needs APTree
+    APTree_flat &flat = model.flat;
+    size_t num_nodes = flat.size();
+
+    if (num_nodes == 0)
+    {
+        Rcpp::stop("corrupted APTree binary file");
+    }
+
+    std::vector<size_t> leaves;
+    leaf_order(flat, 0, leaves);
+
+    // decode_model checks the layout, the leaves found must match the leaf weights read
+    if (leaves.size() != model.leaf_weight.size())
+    {
+        Rcpp::stop("corrupted APTree binary file");
+    }
+
+    root.tonull();
+    root.theta.assign((model.dim_theta == 0) ? 1 : model.dim_theta, 0.0);
+
+    std::vector<APTree *> nodes(num_nodes, (APTree *)0);
+    nodes[0] = &root;
+
+    for (size_t k = 0; k < num_nodes; k++)
+    {
+        APTree *node = nodes[k];
+        node->setdepth(model.depth[k]);
+        if (flat.left[k] != 0)
+        {
+            node->setv(flat.var[k]);
+            node->setc(flat.cutpoint[k]);
+            node->setc_index(model.cutpoint_index[k]);
+
+            APTree *lchild = root.get_arena()->make(root.theta.size());
+            APTree *rchild = root.get_arena()->make(root.theta.size());
+            lchild->setp(node);
+            rchild->setp(node);
+            node->setl(lchild);
+            node->setr(rchild);
+            nodes[flat.left[k]] = lchild;
+            nodes[flat.left[k] + 1] = rchild;
+        }
+    }
+
+    if (!model.theta.empty())
+    {
+        for (size_t i = 0; i < leaves.size(); i++)
+        {
+            APTree *leaf = nodes[leaves[i]];
+            leaf->theta.assign(model.theta.begin() + i * model.dim_theta, model.theta.begin() + (i + 1) * model.dim_theta);
+        }
+    }
+
+    return;
+}
+
+// [[Rcpp::export]]
+void APTree_save_binary_cpp(Rcpp::StringVector json_string, arma::vec leaf_weight, std::string file, bool with_theta = true)
+{
+    std::string j = Rcpp::as<std::string>(json_string(0));
+
+    auto temp = json::parse(j);
+    size_t dim_theta;
+    temp.at("dim_theta").get_to(dim_theta);
+
+    APTree root(dim_theta);
+    json_to_tree(j, root);
+
+    tree_to_binary(root, leaf_weight, with_theta, file);
+
+    return;
+}
+
+// [[Rcpp::export]]
+Rcpp::List APTree_load_binary_cpp(std::string file)
+{
+    APTree_binary model;
+    binary_to_model(file, model);
+
+    APTree root(1);
+    model_to_tree(model, root);
+
+    Rcpp::StringVector json_output(1);
+    json j = tree_to_json(root);
+    json_output[0] = j.dump(4);
+
+    std::vector<size_t> leaves;
+    leaf_order(model.flat, 0, leaves);
+    arma::vec leaf_id(leaves.size());
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+        leaf_id(i) = model.flat.leaf_id[leaves[i]];
+    }
+
+    arma::vec leaf_weight = arma::conv_to<arma::vec>::from(model.leaf_weight);
+
+    Rcpp::XPtr<APTree_flat> handle(new APTree_flat(model.flat), true, Rf_install("APTree_flat"));
+
+    return Rcpp::List::create(
+        Rcpp::Named("json") = json_output,
+        Rcpp::Named("handle") = handle,
+        Rcpp::Named("leaf_id") = leaf_id,
+        Rcpp::Named("leaf_weight") = leaf_weight);
+}
@@ -0,0 +1,36 @@
+#ifndef GUARD_binary_io_
+#define GUARD_binary_io_
+
+#include "APTree.h"
+
+// compact binary format of a fitted APTree, version 1, all numbers little endian
+//
+//  header   char[4] "APTB", uint32 version, num_nodes, num_leaves, dim_theta, flags (bit 0: theta stored)
+//  nodes    breadth first as APTree_flat, each array padded to 8 bytes
+//           uint32 var[num_nodes], left[num_nodes], cutpoint_index[num_nodes], depth[num_nodes]
+//           double cutpoint[num_nodes], uint64 leaf_id[num_nodes]
+//  leaves   in the order of APTree::getbots, the order of leaf_id and leaf_weight of the fit
+//           double leaf_weight[num_leaves], double theta[num_leaves * dim_theta] if stored
+
+#define APTREE_BINARY_VERSION 1
+
+class APTree_binary
+{
+public:
+    APTree_flat flat;
+    std::vector<uint32_t> cutpoint_index;
+    std::vector<uint32_t> depth;
+    std::vector<double> leaf_weight;
+    size_t dim_theta;
+    std::vector<double> theta; // dim_theta per leaf, empty if not stored
+
+    APTree_binary() : dim_theta(0) {}
+};
+
+void tree_to_binary(APTree &root, const arma::vec &leaf_weight, bool with_theta, const std::string &file);
+
+void binary_to_model(const std::string &file, APTree_binary &model);
+
+void model_to_tree(APTree_binary &model, APTree &root);
+
+#endif
@@ -58,41 +58,77 @@ std::ostream &operator<<(std::ostream &out, const std::vector<std::vector<size_t
     return out;
 }
 
-double fastLm(const arma::vec &y, const arma::mat &X)
+static bool ols_residual(const arma::vec &y, const arma::mat &X, lm_workspace &work)
 {
-    // this function calculate sum of residual squares for OLS
-    size_t n = X.n_rows;
-    size_t k = X.n_cols;
+    // OLS residuals from the normal equations, X'X b = X'y by two triangular solves
+    // only the sum of squared residuals is used, so X'X is never inverted
+    // it runs inside the parallel split search, so a failed solve returns false instead of throwing
+    work.XtX = arma::trans(X) * X;
+    work.Xty = arma::trans(X) * y;
+
+    // the normal equations square the condition number of X, use them only if X'X is well conditioned
+    // below sqrt(eps) more than half of the digits would be lost, solve on X itself instead
+    bool solved = false;
+    bool normal_equations = arma::chol(work.chol_upper, work.XtX) && arma::rcond(work.XtX) > std::sqrt(std::numeric_limits<double>::epsilon());
+    if (normal_equations)
+    {
+        solved = arma::solve(work.temp, arma::trimatl(arma::trans(work.chol_upper)), work.Xty) && arma::solve(work.coef, arma::trimatu(work.chol_upper), work.temp);
+    }
 
-    arma::colvec coef = arma::solve(X, y);
-    arma::colvec resid = y - X * coef;
+    if (!solved)
+    {
+        // QR on X, as fastLm did before the normal equations
+        // if X is rank deficient, e.g. ft is zero in every month, the minimum norm least squares solution
+        // both without the warning of the approximate fallback, which worker threads must not print
+        solved = arma::solve(work.coef, X, y, arma::solve_opts::no_approx) || arma::solve(work.coef, X, y, arma::solve_opts::force_approx);
+    }
 
-    double sig2 = arma::as_scalar(arma::trans(resid) * resid / (n - k));
-    arma::colvec stderrest =
-        arma::sqrt(sig2 * arma::diagvec(arma::inv(arma::trans(X) * X)));
+    if (!solved)
+    {
+        return false;
+    }
 
-    arma::colvec temp = arma::pow(resid, 2);
+    work.resid = y - X * work.coef;
 
-    double output = arma::accu(temp);
-    return output;
+    return true;
 }
 
-double fastLm_weighted(const arma::vec &y, const arma::mat &X, const arma::vec &weight)
+double fastLm(const arma::vec &y, const arma::mat &X)
+{
+    lm_workspace work;
+    return fastLm(y, X, work);
+}
+
+double fastLm(const arma::vec &y, const arma::mat &X, lm_workspace &work)
 {
     // this function calculate sum of residual squares for OLS
-    size_t n = X.n_rows;
-    size_t k = X.n_cols;
+    // max of double if the regression has no solution
+    if (!ols_residual(y, X, work))
+    {
+        return std::numeric_limits<double>::max();
+    }
 
-    arma::colvec coef = arma::solve(X, y);
-    arma::colvec resid = y - X * coef;
+    double output = arma::dot(work.resid, work.resid);
+    return output;
+}
 
-    double sig2 = arma::as_scalar(arma::trans(resid) * resid / (n - k));
-    arma::colvec stderrest =
-        arma::sqrt(sig2 * arma::diagvec(arma::inv(arma::trans(X) * X)));
+double fastLm_weighted(const arma::vec &y, const arma::mat &X, const arma::vec &weight)
+{
+    lm_workspace work;
+    return fastLm_weighted(y, X, weight, work);
+}
 
-    arma::colvec temp = arma::pow(resid, 2) % weight;
+double fastLm_weighted(const arma::vec &y, const arma::mat &X, const arma::vec &weight, lm_workspace &work)
+{
+    // this function calculate sum of residual squares for OLS
+    // the regression is unweighted, the weight only applies to the squared residuals
+    // max of double if the regression has no solution
+    if (!ols_residual(y, X, work))
+    {
+        return std::numeric_limits<double>::max();
+    }
 
-    double output = arma::accu(temp);
+    double output = arma::accu(arma::square(work.resid) % weight);
 
     return output;
 }
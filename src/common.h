@@ -7,6 +7,11 @@
 #include <string>
 #include <random>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <exception>
+#include <mutex>
+#include <cstdint>
 #include <map>
 #include <limits>
 #include <cmath>
@@ -29,10 +34,26 @@ std::ostream &operator<<(std::ostream &out, const std::vector<bool> &v);
 std::ostream &operator<<(std::ostream &out, const std::vector<std::vector<double>> &v);
 std::ostream &operator<<(std::ostream &out, const std::vector<std::vector<size_t>> &v);
 
+// scratch space of the least squares kernels, reused across split candidates
+class lm_workspace
+{
+public:
+    arma::mat XtX;
+    arma::vec Xty;
+    arma::mat chol_upper; // upper Cholesky factor of X'X
+    arma::vec temp;       // solution of the lower triangular system
+    arma::vec coef;
+    arma::vec resid;
+};
+
 double fastLm(const arma::vec &y, const arma::mat &X);
 
+double fastLm(const arma::vec &y, const arma::mat &X, lm_workspace &work);
+
 double fastLm_weighted(const arma::vec &y, const arma::mat &X, const arma::vec &weight);
 
+double fastLm_weighted(const arma::vec &y, const arma::mat &X, const arma::vec &weight, lm_workspace &work);
+
 bool sum(std::vector<bool> &v);
 
 class leaf_data
@@ -4,7 +4,10 @@
 json tree_to_json(APTree &root)
 {
     json output;
-    output["dim_theta"] = root.theta.size();
+    // only the leaves keep theta
+    std::vector<APTree *> leaves;
+    root.getbots(leaves);
+    output["dim_theta"] = leaves[0]->theta.size();
     output["num_nodes"] = root.treesize();
 
     json tree_json = root.to_json();
@@ -21,10 +21,97 @@ public:
     virtual double calculate_criterion_one_candidate(State &state, arma::umat &Xorder, size_t var, size_t ind, size_t num_obs) { return 0.0; };
 };
 
+// other leaves of a split search, they are fixed for all candidates of one node
+// used to update the mean variance efficient weight for the two candidate columns only
+class mve_block
+{
+public:
+    arma::uvec others;    // columns of the other leaves in APTreeModel::leaf_portfolio, num_leaves - 1
+    arma::mat chol_upper; // upper Cholesky factor of cov(others) + lambda_cov * I
+    arma::mat solve_mu;   // (cov(others) + lambda_cov * I)^{-1} * (mean(others) + lambda_mean)
+    bool factorized;      // false if the covariance of the other leaves is not positive definite
+
+    mve_block() : factorized(false) {}
+};
+
+// Armadillo types of the k * k normal equations of the Gram criterion
+// fixed size, on the stack and unrolled, for a handful of regressors, K = 0 for any other size
+template <size_t K>
+struct gram_types
+{
+    typedef typename arma::mat::fixed<K, K> mat_type;
+    typedef typename arma::vec::fixed<K> vec_type;
+};
+
+template <>
+struct gram_types<0>
+{
+    typedef arma::mat mat_type;
+    typedef arma::vec vec_type;
+};
+
+// weighted average return of every (month, leaf) cell, the portfolio of a leaf is one column
+// shared by initialize_portfolio in the fit and by predict_APTree_cpp out of sample
+class portfolio_accumulator
+{
+public:
+    arma::mat weighted_return; // sum of w * R, num_months * num_leaves
+    arma::mat weight_sum;      // sum of w
+
+    portfolio_accumulator(size_t num_months, size_t num_leaves) : weighted_return(num_months, num_leaves, arma::fill::zeros), weight_sum(num_months, num_leaves, arma::fill::zeros) {}
+
+    void add(size_t month, size_t leaf, double R, double w)
+    {
+        weighted_return(month, leaf) += R * w;
+        weight_sum(month, leaf) += w;
+    }
+
+    void finalize(arma::mat &portfolio) const
+    {
+        // zero return if the leaf has no data in the month
+        portfolio.set_size(weighted_return.n_rows, weighted_return.n_cols);
+        for (size_t i = 0; i < weighted_return.n_elem; i++)
+        {
+            portfolio(i) = (weight_sum(i) == 0) ? 0.0 : weighted_return(i) / weight_sum(i);
+        }
+    }
+};
+
+class APTreeModel;
+
+// split criterion of one variable at one leaf, an instantiation of calculate_criterion_one_variable
+typedef void (APTreeModel::*criterion_kernel)(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, const mve_block &block, arma::mat &regressor, lm_workspace &lm_work);
+
 class APTreeModel : public Model
 {
 public:
+    // portfolio returns of the current leaves, num_months * num_leaves, column APTree::portfolio_col of each leaf
+    // a split overwrites the column of the parent with the left child and appends the right child
+    arma::mat leaf_portfolio;
+
     arma::mat regressor;
+    std::vector<arma::mat> thread_regressor;  // scratch regressor of threads 1, 2, ..., only during calculate_criterion
+    lm_workspace lm_work;                     // scratch space of fastLm / fastLm_weighted
+    std::vector<lm_workspace> thread_lm_work; // same for threads 1, 2, ...
+
+    // month level Gram blocks of the pricing regression Yt ~ Zt * ft + Ht, for state.gram_loss
+    // column t of ZZ_month is vec(Z_t' Z_t), so X'X = sum_t ft^2 * Z_t' Z_t is one matrix-vector product
+    arma::mat ZZ_month; // num_Z^2 * num_months
+    arma::mat ZH_month; // (num_Z * num_H) * num_months
+    arma::mat ZY_month; // num_Z * num_months
+    arma::mat HH;
+    arma::vec HY;
+    double YY;
+    // same blocks weighted by loss_weight, for state.weighted_loss
+    arma::mat ZZ_month_weighted;
+    arma::mat ZH_month_weighted;
+    arma::mat ZY_month_weighted;
+    arma::mat HH_weighted;
+    arma::vec HY_weighted;
+    double YY_weighted;
+
+    // value of each first split variable in each month, NaN where it is not constant within the month
+    arma::mat month_macro; // num_months * num first_split_var
 
     APTreeModel(double lambda) : Model(1.0) { this->lambda = lambda; }
 
@@ -42,13 +129,38 @@ public:
 
     void initialize_regressor_matrix(State &state);
 
-    void predict_AP(arma::mat &X, APTree &root, arma::vec &months, arma::vec &leaf_index);
+    void initialize_gram_matrix(State &state);
+
+    template <typename mat_type, typename vec_type>
+    void assemble_gram_matrix(State &state, const arma::vec &ft, bool weighted, mat_type &XtX, vec_type &XtY);
+
+    double calculate_loss_gram(State &state, const arma::vec &ft);
+
+    template <bool weighted_loss>
+    double calculate_loss_gram_mode(State &state, const arma::vec &ft);
+
+    template <bool weighted_loss, size_t K>
+    double solve_loss_gram(State &state, const arma::vec &ft);
+
+    void predict_AP(const arma::mat &X, APTree &root, const arma::vec &months, arma::vec &leaf_index);
+
+    // the training modes checked for every candidate are template parameters, so each variant is compiled branch free
+    template <bool gram_loss, bool weighted_loss, bool abs_normalize, bool stop_no_gain>
+    void calculate_criterion_one_variable(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, const mve_block &block, arma::mat &regressor, lm_workspace &lm_work);
+
+    criterion_kernel select_criterion_kernel(State &state);
+
+    void initialize_mve_block(State &state, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, mve_block &block);
+
+    bool mve_weight(State &state, const arma::mat &candidate_portfolio, const mve_block &block, arma::mat &weight);
+
+    void cutpoint_sufficient_stat(State &state, APTree *node, size_t var);
 
-    void calculate_criterion_one_variable(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all);
+    void initialize_month_macro(State &state);
 
     void calculate_criterion_one_variable_APTree_TS(State &state, size_t var, std::vector<APTree *> &bottom_nodes_vec, size_t node_ind, std::vector<double> &output, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all, size_t var_ind);
 
-    void node_sufficient_stat(State &state, arma::umat &Xorder, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all);
+    void node_sufficient_stat(State &state, APTree *node, arma::vec &weighted_return_all, arma::vec &cumu_weight_all, arma::vec &num_stocks_all);
 
     void calculate_factor(APTree &root, arma::vec &leaf_node_index, arma::mat &all_leaf_portfolio, arma::mat &leaf_weight, arma::mat &ft, State &state);
 
@@ -0,0 +1,197 @@
+#include "panel.h"
+#include <cstring>
+
+static inline uint64_t radix_key(double x)
+{
+    // order preserving map of doubles to unsigned integers, -0.0 and 0.0 get the same key as they compare equal
+    if (x == 0.0)
+    {
+        x = 0.0;
+    }
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(double));
+    return (bits >> 63) ? ~bits : (bits | ((uint64_t)1 << 63));
+}
+
+void argsort_column(const double *x, size_t n, uint32_t *order, argsort_workspace &work)
+{
+    work.key.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        work.key[i] = radix_key(x[i]);
+        order[i] = (uint32_t)i;
+    }
+
+    if (n < 4096)
+    {
+        // four counting passes do not pay off on short columns
+        const uint64_t *key = work.key.data();
+        std::stable_sort(order, order + n, [key](uint32_t a, uint32_t b)
+                         { return key[a] < key[b]; });
+        return;
+    }
+
+    work.key_temp.resize(n);
+    work.index_temp.resize(n);
+    work.count.resize(65536);
+
+    uint64_t *key_in = work.key.data();
+    uint64_t *key_out = work.key_temp.data();
+    uint32_t *index_in = order;
+    uint32_t *index_out = work.index_temp.data();
+
+    // least significant 16 bits first, every pass is stable
+    for (size_t shift = 0; shift < 64; shift += 16)
+    {
+        std::fill(work.count.begin(), work.count.end(), 0);
+        for (size_t i = 0; i < n; i++)
+        {
+            work.count[(key_in[i] >> shift) & 0xFFFF]++;
+        }
+
+        if (work.count[(key_in[0] >> shift) & 0xFFFF] == n)
+        {
+            // all keys share this digit, e.g. the low bits of ranks
+            continue;
+        }
+
+        size_t total = 0;
+        for (size_t d = 0; d < 65536; d++)
+        {
+            size_t c = work.count[d];
+            work.count[d] = total;
+            total += c;
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t pos = work.count[(key_in[i] >> shift) & 0xFFFF]++;
+            key_out[pos] = key_in[i];
+            index_out[pos] = index_in[i];
+        }
+
+        std::swap(key_in, key_out);
+        std::swap(index_in, index_out);
+    }
+
+    if (index_in != order)
+    {
+        std::copy(index_in, index_in + n, order);
+    }
+
+    return;
+}
+
+APTree_panel::APTree_panel(const arma::mat &X, const arma::vec &months, const arma::vec &unique_months, size_t num_cutpoints, bool copy_data, size_t num_threads, bool compact)
+{
+    if (X.n_rows >= std::numeric_limits<uint32_t>::max())
+    {
+        Rcpp::stop("the panel holds at most 2^32 - 2 observations, Xorder stores 32 bit row ids");
+    }
+
+    this->num_obs = X.n_rows;
+    this->num_vars = X.n_cols;
+    this->compact = compact;
+
+    if (compact)
+    {
+        // X_data stays empty
+        this->X_float = arma::conv_to<arma::fmat>::from(X);
+        this->months_data = months;
+        this->X = &this->X_data;
+        this->months = &this->months_data;
+    }
+    else if (copy_data)
+    {
+        this->X_data = X;
+        this->months_data = months;
+        this->X = &this->X_data;
+        this->months = &this->months_data;
+    }
+    else
+    {
+        this->X = &X;
+        this->months = &months;
+    }
+
+    // we assume the number of months is continuous
+    this->num_months = unique_months.n_elem;
+    for (size_t i = 0; i < num_months; i++)
+    {
+        months_list[unique_months(i)] = i;
+    }
+
+    month_index.resize(X.n_rows);
+    for (size_t i = 0; i < X.n_rows; i++)
+    {
+        month_index[i] = months_list.at(months(i));
+    }
+
+    // calculate Xorder matrix, each index is row index of the data in the X matrix, but sorted from low to high
+    // columns are sorted independently and ties keep the row order, so Xorder does not depend on the number of threads
+    num_threads = (num_threads == 0) ? 1 : num_threads;
+    std::vector<argsort_workspace> work(num_threads);
+    Xorder.set_size(X.n_rows, X.n_cols);
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (size_t i = 0; i < X.n_cols; i++)
+    {
+        argsort_column(X.colptr(i), X.n_rows, Xorder.colptr(i), work[omp_get_thread_num()]);
+    }
+
+    this->num_cutpoints = num_cutpoints;
+    compute_bin_code(X, uniform_split_candidates(num_cutpoints), bin_code);
+
+    if (compact && bin_code.n_elem == 0)
+    {
+        // no bin codes and no double X, nothing left for the split search to read
+        Rcpp::stop("a compact panel supports fewer than 255 cutpoints");
+    }
+}
+
+const arma::Mat<uint8_t> *APTree_panel::fit_bin_code(size_t num_cutpoints, arma::Mat<uint8_t> &bin_code_fit) const
+{
+    if (this->num_cutpoints == num_cutpoints)
+    {
+        return &this->bin_code;
+    }
+
+    if (!this->compact)
+    {
+        return 0;
+    }
+
+    // x is compared in float32, it can fall on the other side of a cutpoint within float rounding of it
+    compute_bin_code(this->X_float, uniform_split_candidates(num_cutpoints), bin_code_fit);
+    if (bin_code_fit.n_elem == 0)
+    {
+        Rcpp::stop("a compact panel supports fewer than 255 cutpoints");
+    }
+
+    return &bin_code_fit;
+}
+
+APTree_panel *panel_from_sexp(SEXP panel)
+{
+    // the tag set by APTree_panel_cpp, any other external pointer is rejected before the cast
+    if (TYPEOF(panel) != EXTPTRSXP || R_ExternalPtrTag(panel) != Rf_install("APTree_panel"))
+    {
+        Rcpp::stop("panel is not a prepared APTree panel, see APTree_panel");
+    }
+
+    if (R_ExternalPtrAddr(panel) == 0)
+    {
+        // external pointers do not survive saving the R session
+        Rcpp::stop("panel is not a prepared APTree panel, prepare it again with APTree_panel");
+    }
+
+    return (APTree_panel *)R_ExternalPtrAddr(panel);
+}
+
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::export]]
+SEXP APTree_panel_cpp(const arma::mat &X, const arma::vec &months, const arma::vec &unique_months, size_t num_cutpoints = 4, size_t num_threads = 1, bool compact = false)
+{
+    Rcpp::XPtr<APTree_panel> panel(new APTree_panel(X, months, unique_months, num_cutpoints, true, num_threads, compact), true, Rf_install("APTree_panel"));
+
+    return panel;
+}
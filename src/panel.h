@@ -0,0 +1,60 @@
+#ifndef GUARD_panel_h
+#define GUARD_panel_h
+
+#include "state.h"
+
+// scratch space of argsort_column, one per thread
+class argsort_workspace
+{
+public:
+    std::vector<uint64_t> key;
+    std::vector<uint64_t> key_temp;
+    std::vector<uint32_t> index_temp;
+    std::vector<size_t> count;
+};
+
+// row indices of the column x sorted from low to high, ties keep the row order
+// the order of a stable sort, but by LSD radix sort on the bits of the doubles for long columns
+void argsort_column(const double *x, size_t n, uint32_t *order, argsort_workspace &work);
+
+// everything a fit derives from X and months alone, built once and shared by every fit on the same panel
+// boosting rounds, hyperparameter sweeps and bootstrap runs on one X skip the sort and the binning
+class APTree_panel
+{
+public:
+    const arma::mat *X; // empty for a compact panel
+    const arma::vec *months;
+    size_t num_obs;
+    size_t num_vars;
+    size_t num_months;
+    std::map<size_t, size_t> months_list; // month to index from zero to num_months - 1
+    std::vector<uint32_t> month_index;    // dense month index of every observation
+    arma::Mat<uint32_t> Xorder;           // every column of X sorted from low to high, fits partition a copy
+    size_t num_cutpoints;
+    arma::Mat<uint8_t> bin_code; // as State::bin_code, for num_cutpoints uniform cutpoints
+
+    // a compact panel keeps X in float32 and no double copy, fits on it only read bin codes
+    // Xorder and bin_code are computed from the double X, so they are exact
+    bool compact;
+    arma::fmat X_float;
+
+    // copy_data keeps copies of X and months, for a panel that outlives the inputs, otherwise it points at them
+    // compact implies copy_data
+    APTree_panel(const arma::mat &X, const arma::vec &months, const arma::vec &unique_months, size_t num_cutpoints, bool copy_data, size_t num_threads = 1, bool compact = false);
+
+    // bin codes of a fit with num_cutpoints uniform cutpoints, the panel's own if the cutpoints match
+    // a compact panel bins its float32 X into bin_code_fit, otherwise 0 and the fit bins X itself
+    const arma::Mat<uint8_t> *fit_bin_code(size_t num_cutpoints, arma::Mat<uint8_t> &bin_code_fit) const;
+
+    APTree_panel(const APTree_panel &) = delete;
+    APTree_panel &operator=(const APTree_panel &) = delete;
+
+private:
+    arma::mat X_data;
+    arma::vec months_data;
+};
+
+// prepared panel behind an R external pointer, stops if the pointer is not a live panel
+APTree_panel *panel_from_sexp(SEXP panel);
+
+#endif
@@ -5,28 +5,106 @@
 #include "json_io.h"
 #include "json.h"
 
+static APTree_flat *handle_to_tree(SEXP handle, Rcpp::StringVector &json_string, APTree_flat &local)
+{
+    // the compiled tree behind a handle returned by the fit or by APTree_handle_cpp
+    // external pointers are null after the R session is saved and restored, rebuild from the json once
+    // without a handle (fits of older versions) parse the json into local for this call only
+    // same for any external pointer without the tag set where the handles are created, it is never cast
+    if (TYPEOF(handle) != EXTPTRSXP || R_ExternalPtrTag(handle) != Rf_install("APTree_flat"))
+    {
+        auto temp = json::parse(Rcpp::as<std::string>(json_string(0)));
+        local.from_json(temp);
+        return &local;
+    }
+
+    APTree_flat *flat = (APTree_flat *)R_ExternalPtrAddr(handle);
+
+    if (flat == 0)
+    {
+        auto temp = json::parse(Rcpp::as<std::string>(json_string(0)));
+        flat = new APTree_flat(temp);
+        R_SetExternalPtrAddr(handle, flat);
+        R_RegisterCFinalizerEx(handle, Rcpp::finalizer_wrapper<APTree_flat, Rcpp::standard_delete_finalizer<APTree_flat>>, FALSE);
+    }
+
+    return flat;
+}
+
 // [[Rcpp::export]]
-Rcpp::List predict_APTree_cpp(arma::mat X, Rcpp::StringVector json_string, arma::vec months)
+Rcpp::List predict_APTree_cpp(const arma::mat &X, SEXP handle, Rcpp::StringVector json_string, const arma::vec &months, const arma::vec &R, const arma::vec &weight, const arma::vec &leaf_id, const arma::mat &leaf_weight)
 {
     size_t N = X.n_rows;
 
     arma::vec leaf_index(N);
 
-    std::vector<std::string> j(json_string.size());
-    j[0] = json_string(0);
+    // only the split structure is needed, no APTree is built
+    APTree_flat local;
+    const APTree_flat &flat = *handle_to_tree(handle, json_string, local);
+    flat.check_columns(X);
 
-    size_t dim_theta;
-    auto temp = json::parse(j[0]);
-    temp.at("dim_theta").get_to(dim_theta);
+    // months of the test data, counted from zero in increasing order
+    arma::vec unique_months = arma::unique(months);
+    size_t num_months = unique_months.n_elem;
+    std::map<size_t, size_t> months_list;
+    for (size_t i = 0; i < num_months; i++)
+    {
+        months_list[unique_months(i)] = i;
+    }
 
-    APTree *root = new APTree(dim_theta);
+    // column of every leaf in the portfolio matrix, same order as leaf_id of the fit
+    std::map<size_t, size_t> leaf_list;
+    for (size_t i = 0; i < leaf_id.n_elem; i++)
+    {
+        leaf_list[leaf_id(i)] = i;
+    }
 
-    json_to_tree(j[0], *root);
+    // one pass, find the leaf of every row and add it to the (month, leaf) portfolio
+    portfolio_accumulator accumulator(num_months, leaf_id.n_elem);
+    std::map<size_t, size_t>::const_iterator leaf;
+    for (size_t i = 0; i < N; i++)
+    {
+        leaf_index(i) = flat.find_leaf(X, i);
+        leaf = leaf_list.find(leaf_index(i));
+        if (leaf != leaf_list.end())
+        {
+            accumulator.add(months_list.at(months(i)), leaf->second, R(i), weight(i));
+        }
+    }
 
-    APTreeModel *model = new APTreeModel(1.0);
+    arma::mat portfolio;
+    accumulator.finalize(portfolio);
 
-    model->predict_AP(X, *root, months, leaf_index);
+    arma::mat ft = portfolio * leaf_weight;
 
     return Rcpp::List::create(
-        Rcpp::Named("leaf_index") = leaf_index);
+        Rcpp::Named("leaf_index") = leaf_index,
+        Rcpp::Named("portfolio") = portfolio,
+        Rcpp::Named("ft") = ft);
+}
+
+// [[Rcpp::export]]
+SEXP APTree_handle_cpp(Rcpp::StringVector json_string)
+{
+    // parse the json once, for fits that do not carry a handle
+    std::string j = Rcpp::as<std::string>(json_string(0));
+    auto temp = json::parse(j);
+
+    Rcpp::XPtr<APTree_flat> handle(new APTree_flat(temp), true, Rf_install("APTree_flat"));
+
+    return handle;
+}
+
+// [[Rcpp::export]]
+Rcpp::IntegerVector predict_APTree_batch_cpp(SEXP handle, Rcpp::StringVector json_string, const arma::mat &X, size_t num_threads = 1)
+{
+    // leaf id of every row of X, in a new vector, an R vector passed in may be shared with other bindings
+    APTree_flat local;
+    APTree_flat *flat = handle_to_tree(handle, json_string, local);
+
+    Rcpp::IntegerVector leaf_index(X.n_rows);
+
+    flat->predict(X, leaf_index.begin(), (num_threads == 0) ? 1 : num_threads);
+
+    return leaf_index;
 }
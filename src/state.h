@@ -2,30 +2,76 @@
 #define GUARD_state_h
 #include "common.h"
 
+// cutpoint candidates evenly spaced in (-1, 1), the characteristics are normalized to this range
+inline std::vector<double> uniform_split_candidates(size_t num_cutpoints)
+{
+    std::vector<double> split_candidates(num_cutpoints);
+    for (size_t i = 0; i < num_cutpoints; i++)
+    {
+        split_candidates[i] = 2.0 / (num_cutpoints + 1) * (i + 1) - 1;
+    }
+    return split_candidates;
+}
+
+// bin of every observation for every characteristic, see State::bin_code
+// bin k collects split_candidates[k - 1] < x <= split_candidates[k], bin num_cutpoints is above all cutpoints
+// left empty if the number of cutpoints does not fit in uint8
+template <typename eT>
+inline void compute_bin_code(const arma::Mat<eT> &X, const std::vector<double> &split_candidates, arma::Mat<uint8_t> &bin_code)
+{
+    size_t num_cutpoints = split_candidates.size();
+
+    if (num_cutpoints >= std::numeric_limits<uint8_t>::max())
+    {
+        bin_code.reset();
+        return;
+    }
+
+    bin_code.set_size(X.n_rows, X.n_cols);
+    for (size_t j = 0; j < X.n_cols; j++)
+    {
+        for (size_t i = 0; i < X.n_rows; i++)
+        {
+            // written as !(x <= c) so that NaN falls in the last bin, as in the comparisons with X
+            size_t k = 0;
+            while (k < num_cutpoints && !(X(i, j) <= split_candidates[k]))
+            {
+                k++;
+            }
+            bin_code(i, j) = (uint8_t)k;
+        }
+    }
+}
+
 class State
 {
 
 public:
-    arma::mat *X; // pointer to the charateristics matrix
-    arma::vec *Y;
-    arma::vec *R; // pointer to the return vector
+    const arma::mat *X; // pointer to the charateristics matrix
+    const arma::vec *Y;
+    const arma::vec *R; // pointer to the return vector
     arma::mat *R_mat; // pointer to the return matrix, for TSTree only
-    arma::mat *Z; // placeholder
+    const arma::mat *Z; // placeholder
     arma::mat *F; // for Bayes tree
     arma::mat *regressor; // for Bayes tree
-    arma::mat *H; // placeholder
-    arma::vec *weight;
-    arma::vec *loss_weight;
-    arma::vec *stocks; // pointer to the index of stocks, same number of rows as X
-    arma::vec *months; // months indicator
-    arma::vec *first_split_var;
-    arma::vec *second_split_var;
+    const arma::mat *H; // placeholder
+    const arma::vec *weight;
+    const arma::vec *loss_weight;
+    const arma::vec *stocks; // pointer to the index of stocks, same number of rows as X
+    const arma::vec *months; // months indicator
+    const arma::vec *first_split_var;
+    const arma::vec *second_split_var;
     // the two vectors below are for the APTree model 2, first cut at Macro variable
-    arma::vec *third_split_var;
-    arma::vec *deep_split_var;
-    arma::mat *first_split_mat; // for APTree model 2 only
+    const arma::vec *third_split_var;
+    const arma::vec *deep_split_var;
+    const arma::mat *first_split_mat; // for APTree model 2 only
     arma::mat *split_candidate_mat;
     std::map<size_t, size_t> *months_list; // list of UNIQUE months
+    std::vector<uint32_t> *month_index;    // dense month index of every observation, months_list->at(months(i)) precomputed
+    // rows of the data in this fit, all rows if 0
+    // a regime subtree of APTree model2 fits the rows of its months only, X, R, Z and H are never copied
+    // Y and loss_weight are then gathered to these rows and indexed by position, everything else by row
+    const std::vector<uint32_t> *obs_index;
 
     size_t num_obs_all;
     size_t num_stocks;
@@ -35,12 +81,19 @@ public:
     size_t num_cutpoints;
     size_t num_regressors; // for Bayes tree
     size_t p;              // number of charateristics
+    size_t num_threads;    // number of threads of the split search
     std::vector<double> split_candidates;
+    // bin of every observation for every characteristic, X(i, j) <= split_candidates[k] iff bin_code(i, j) <= k
+    // empty if num_cutpoints does not fit in uint8, then split search reads X directly
+    // points at bin_code_data, or at the bin codes of a prepared panel
+    const arma::Mat<uint8_t> *bin_code;
+    arma::Mat<uint8_t> bin_code_data;
     bool equal_weight;
     bool no_H;
     bool abs_normalize;
     bool weighted_loss;
     bool stop_no_gain;
+    bool gram_loss; // evaluate split criterion with month level Gram matrices instead of the N-row regression
     double overall_loss;
     double sigma;
     double tau;
@@ -60,7 +113,7 @@ public:
     size_t p_spike_slab;
 
     // state for APTree model
-    State(arma::mat &X, arma::vec &Y, arma::vec &R, arma::mat &Z, arma::mat &H, arma::vec &portfolio_weight, arma::vec &loss_weight, arma::vec &stocks, arma::vec &months, arma::vec &first_split_var, arma::vec &second_split_var, size_t &num_months, std::map<size_t, size_t> &months_list, size_t &num_stocks, size_t &min_leaf_size, size_t &max_depth, size_t &num_cutpoints, bool &equal_weight, bool &no_H, bool &abs_normalize, bool &weighted_loss, bool &stop_no_gain, double &eta, double &lambda_mean, double &lambda_cov)
+    State(const arma::mat &X, const arma::vec &Y, const arma::vec &R, const arma::mat &Z, const arma::mat &H, const arma::vec &portfolio_weight, const arma::vec &loss_weight, const arma::vec &stocks, const arma::vec &months, const arma::vec &first_split_var, const arma::vec &second_split_var, size_t &num_months, std::map<size_t, size_t> &months_list, std::vector<uint32_t> &month_index, size_t &num_stocks, size_t &min_leaf_size, size_t &max_depth, size_t &num_cutpoints, bool &equal_weight, bool &no_H, bool &abs_normalize, bool &weighted_loss, bool &stop_no_gain, bool &gram_loss, double &eta, double &lambda_mean, double &lambda_cov, size_t &num_threads, const arma::Mat<uint8_t> *bin_code = 0)
     {
         this->X = &X;
         this->Y = &Y;
@@ -72,6 +125,8 @@ public:
         this->stocks = &stocks;
         this->months = &months;
         this->months_list = &months_list;
+        this->month_index = &month_index;
+        this->obs_index = 0;
         this->first_split_var = &first_split_var;
         this->second_split_var = &second_split_var;
         this->third_split_var = 0;
@@ -81,33 +136,43 @@ public:
         this->min_leaf_size = min_leaf_size;
         this->max_depth = max_depth;
         this->num_cutpoints = num_cutpoints;
-        this->split_candidates.resize(num_cutpoints);
-        this->p = X.n_cols;
-        this->num_obs_all = X.n_rows;
+        // a compact panel hands over an empty X, the bin codes carry the dimensions
+        this->p = (X.n_elem == 0 && bin_code) ? bin_code->n_cols : X.n_cols;
+        this->num_obs_all = (X.n_elem == 0 && bin_code) ? bin_code->n_rows : X.n_rows;
         this->equal_weight = equal_weight;
         this->no_H = no_H;
         this->abs_normalize = abs_normalize;
         this->weighted_loss = weighted_loss;
         this->stop_no_gain = stop_no_gain;
+        this->gram_loss = gram_loss;
         this->overall_loss = std::numeric_limits<double>::max();
         this->sigma = 0.0;
         this->tau = 0.0;
         this->lambda = 0.0;
         this->eta = eta;
+        this->flag_first_cut = false;
         this->first_split_mat = 0;
         this->num_regressors = 0;
         this->lambda_mean = lambda_mean;
         this->lambda_cov = lambda_cov;
-        for (size_t i = 0; i < num_cutpoints; i++)
+        this->num_threads = (num_threads == 0) ? 1 : num_threads;
+        this->split_candidates = uniform_split_candidates(num_cutpoints);
+
+        if (bin_code)
+        {
+            // computed once for the same X and cutpoints, e.g. by a prepared panel
+            this->bin_code = bin_code;
+        }
+        else
         {
-            split_candidates[i] = 2.0 / (num_cutpoints + 1) * (i + 1) - 1;
+            this->initialize_bin_code();
         }
 
         cout << "The split value candidates are " << split_candidates << endl;
     }
 
     // state for APTree model2
-    State(arma::mat &X, arma::vec &Y, arma::vec &R, arma::mat &Z, arma::mat &H, arma::vec &portfolio_weight, arma::vec &loss_weight, arma::vec &stocks, arma::vec &months, arma::vec &first_split_var, arma::vec &second_split_var, arma::vec &third_split_var, arma::vec &deep_split_var, size_t &num_months, std::map<size_t, size_t> &months_list, size_t &num_stocks, size_t &min_leaf_size, size_t &max_depth, size_t &num_cutpoints, bool &equal_weight, bool &no_H, bool &abs_normalize, bool &weighted_loss, bool &stop_no_gain, double &lambda, size_t &num_obs_all, arma::mat &first_split_mat)
+    State(const arma::mat &X, const arma::vec &Y, const arma::vec &R, const arma::mat &Z, const arma::mat &H, const arma::vec &portfolio_weight, const arma::vec &loss_weight, const arma::vec &stocks, const arma::vec &months, const arma::vec &first_split_var, const arma::vec &second_split_var, const arma::vec &third_split_var, const arma::vec &deep_split_var, size_t &num_months, std::map<size_t, size_t> &months_list, std::vector<uint32_t> &month_index, size_t &num_stocks, size_t &min_leaf_size, size_t &max_depth, size_t &num_cutpoints, bool &equal_weight, bool &no_H, bool &abs_normalize, bool &weighted_loss, bool &stop_no_gain, bool &gram_loss, double &lambda, size_t &num_obs_all, const arma::mat &first_split_mat)
     {
         this->X = &X;
         this->Y = &Y;
@@ -119,6 +184,8 @@ public:
         this->stocks = &stocks;
         this->months = &months;
         this->months_list = &months_list;
+        this->month_index = &month_index;
+        this->obs_index = 0;
         this->first_split_var = &first_split_var;
         this->second_split_var = &second_split_var;
         this->third_split_var = &third_split_var;
@@ -128,29 +195,108 @@ public:
         this->min_leaf_size = min_leaf_size;
         this->max_depth = max_depth;
         this->num_cutpoints = num_cutpoints;
-        this->split_candidates.resize(num_cutpoints);
         this->p = X.n_cols;
         this->equal_weight = equal_weight;
         this->no_H = no_H;
         this->abs_normalize = abs_normalize;
         this->weighted_loss = weighted_loss;
         this->stop_no_gain = stop_no_gain;
+        this->gram_loss = gram_loss;
         this->overall_loss = std::numeric_limits<double>::max();
         this->sigma = 0.0;
         this->tau = 0.0;
         this->lambda = lambda;
         this->eta = 0.0;
+        // the macro split sends whole months to one side, the per month leaf size check does not apply
+        this->flag_first_cut = true;
+        // used by calculate_factor
+        this->lambda_mean = 0.0;
+        this->lambda_cov = lambda;
         this->num_obs_all = num_obs_all;
         this->first_split_mat = &first_split_mat;
         this->num_regressors = 0;
-        for (size_t i = 0; i < num_cutpoints; i++)
+        this->num_threads = 1;
+        this->split_candidates = uniform_split_candidates(num_cutpoints);
+        this->bin_code = &this->bin_code_data;
+
+        cout << "The split value candidates are " << split_candidates << endl;
+    }
+
+    // state for a regime subtree of APTree model2, the rows in obs_index, all in months on one side of the macro split
+    // shares the data and settings of the time series state, month_index is dense over the months of the regime
+    // the subtree is the usual cross sectional tree, second_split_var at depth 2, third_split_var at depth 3, deep_split_var below
+    State(const State &ts_state, const std::vector<uint32_t> &obs_index, const arma::vec &Y, const arma::vec &loss_weight, size_t num_months, std::map<size_t, size_t> &months_list, std::vector<uint32_t> &month_index, const arma::Mat<uint8_t> *bin_code, size_t num_threads, double eta)
+    {
+        this->X = ts_state.X;
+        this->Y = &Y;
+        this->R = ts_state.R;
+        this->R_mat = 0;
+        this->Z = ts_state.Z;
+        this->F = 0;
+        this->regressor = 0;
+        this->H = ts_state.H;
+        this->weight = ts_state.weight;
+        this->loss_weight = &loss_weight;
+        this->stocks = ts_state.stocks;
+        this->months = ts_state.months;
+        this->first_split_var = ts_state.first_split_var;
+        this->second_split_var = ts_state.second_split_var;
+        this->third_split_var = ts_state.third_split_var;
+        this->deep_split_var = ts_state.deep_split_var;
+        this->first_split_mat = ts_state.first_split_mat;
+        this->split_candidate_mat = 0;
+        this->months_list = &months_list;
+        this->month_index = &month_index;
+        this->obs_index = &obs_index;
+        this->num_obs_all = obs_index.size();
+        this->num_stocks = ts_state.num_stocks;
+        this->num_months = num_months;
+        this->min_leaf_size = ts_state.min_leaf_size;
+        this->max_depth = ts_state.max_depth;
+        this->num_cutpoints = ts_state.num_cutpoints;
+        this->num_regressors = 0;
+        this->p = ts_state.p;
+        this->num_threads = (num_threads == 0) ? 1 : num_threads;
+        this->split_candidates = ts_state.split_candidates;
+        this->equal_weight = ts_state.equal_weight;
+        this->no_H = ts_state.no_H;
+        this->abs_normalize = ts_state.abs_normalize;
+        this->weighted_loss = ts_state.weighted_loss;
+        this->stop_no_gain = ts_state.stop_no_gain;
+        this->gram_loss = ts_state.gram_loss;
+        this->overall_loss = std::numeric_limits<double>::max();
+        this->sigma = 0.0;
+        this->tau = 0.0;
+        this->lambda = ts_state.lambda;
+        // leaf weights of the regime, eta is an argument of the fit, the macro split itself does not use it
+        this->eta = eta;
+        this->lambda_mean = ts_state.lambda_mean;
+        this->lambda_cov = ts_state.lambda_cov;
+        this->flag_first_cut = false;
+
+        if (bin_code)
+        {
+            this->bin_code = bin_code;
+        }
+        else
         {
-            split_candidates[i] = 2.0 / (num_cutpoints + 1) * (i + 1) - 1;
+            this->initialize_bin_code();
         }
+    }
 
-        cout << "The split value candidates are " << split_candidates << endl;
+    // row of the data of the i-th observation of this fit
+    size_t obs(size_t i) const { return obs_index ? (*obs_index)[i] : i; }
+
+    void initialize_bin_code()
+    {
+        // the cutpoints are fixed, so the bin of every observation never changes during training
+        compute_bin_code(*X, split_candidates, bin_code_data);
+        bin_code = &bin_code_data;
     }
 
+    // holds pointers into itself
+    State(const State &) = delete;
+    State &operator=(const State &) = delete;
 };
 
 #endif
\ No newline at end of file
@@ -482,7 +482,7 @@ void tree::split_Xorder(arma::umat &Xorder_left, arma::umat &Xorder_right, arma:
     return;
 }
 
-void tree::predict(arma::mat X, arma::vec months, arma::vec &output)
+void tree::predict(arma::mat &X, const arma::vec &months, arma::vec &output)
 {
     size_t N_test = X.n_rows;
 
@@ -75,7 +75,7 @@ public:
     // growing functions
     void grow(State &state, Model &model, arma::umat &Xorder);
     void split_Xorder(arma::umat &Xorder_left, arma::umat &Xorder_right, arma::umat &Xorder, size_t split_point, size_t split_var, State &state, Model &model);
-    void predict(arma::mat X, arma::vec months, arma::vec &output);
+    void predict(arma::mat &X, const arma::vec &months, arma::vec &output);
 
     // input and output to json
     json to_json();
@@ -0,0 +1,73 @@
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::plugins(openmp)]]
+#include "../../src/common.cpp"
+
+// fastLm before the RSS-only kernel, solve + explicit inverse for standard errors
+double fastLm_reference(const arma::vec &y, const arma::mat &X)
+{
+    size_t n = X.n_rows;
+    size_t k = X.n_cols;
+
+    arma::colvec coef = arma::solve(X, y);
+    arma::colvec resid = y - X * coef;
+
+    double sig2 = arma::as_scalar(arma::trans(resid) * resid / (n - k));
+    arma::colvec stderrest =
+        arma::sqrt(sig2 * arma::diagvec(arma::inv(arma::trans(X) * X)));
+
+    return arma::accu(arma::pow(resid, 2));
+}
+
+// [[Rcpp::export]]
+Rcpp::DataFrame bench_fastlm(size_t n, Rcpp::IntegerVector k_list, size_t num_rep)
+{
+    // average time in microseconds of one call, as for one split candidate of the criterion
+    size_t num_k = k_list.size();
+    Rcpp::NumericVector time_reference(num_k);
+    Rcpp::NumericVector time_lean(num_k);
+    Rcpp::NumericVector rel_diff(num_k);
+    Rcpp::NumericVector rel_diff_collinear(num_k);
+
+    lm_workspace work;
+    arma::wall_clock timer;
+
+    for (size_t j = 0; j < num_k; j++)
+    {
+        size_t k = k_list[j];
+        arma::mat X(n, k, arma::fill::randn);
+        arma::vec y = X * arma::randn<arma::vec>(k) + arma::randn<arma::vec>(n);
+
+        double rss_reference = 0.0;
+        double rss_lean = 0.0;
+
+        timer.tic();
+        for (size_t rep = 0; rep < num_rep; rep++)
+        {
+            rss_reference = fastLm_reference(y, X);
+        }
+        time_reference[j] = timer.toc() / num_rep * 1e6;
+
+        timer.tic();
+        for (size_t rep = 0; rep < num_rep; rep++)
+        {
+            rss_lean = fastLm(y, X, work);
+        }
+        time_lean[j] = timer.toc() / num_rep * 1e6;
+
+        rel_diff[j] = std::abs(rss_lean - rss_reference) / rss_reference;
+
+        // two nearly collinear columns, X'X is poorly conditioned and the kernel falls back to QR
+        arma::mat X_collinear = X;
+        X_collinear.col(k - 1) = X.col(0) + 1e-7 * arma::randn<arma::vec>(n);
+        rss_reference = fastLm_reference(y, X_collinear);
+        rss_lean = fastLm(y, X_collinear, work);
+        rel_diff_collinear[j] = std::abs(rss_lean - rss_reference) / rss_reference;
+    }
+
+    return Rcpp::DataFrame::create(Rcpp::Named("k") = k_list,
+                                   Rcpp::Named("reference_us") = time_reference,
+                                   Rcpp::Named("lean_us") = time_lean,
+                                   Rcpp::Named("speedup") = time_reference / time_lean,
+                                   Rcpp::Named("rel_diff") = rel_diff,
+                                   Rcpp::Named("rel_diff_collinear") = rel_diff_collinear);
+}
@@ -0,0 +1 @@
+Rscript main.R > main.out.txt 2>&1
\ No newline at end of file